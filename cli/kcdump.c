@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2010  Daniel Elstner <daniel.kitta@gmail.com>
+ *
+ * KC-Dump is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KC-Dump is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <build/config.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <libkc/libkc.h>
+
+#define BAUDRATE_NORMAL B1200
+#define BAUDRATE_BOOST  B19200
+#define DUMP_WINDOW     4       /* requests in flight before waiting for a block */
+#define DUMP_RETRIES    5       /* requests of a block before giving up */
+#define REPLY_TIMEOUT   2000    /* milliseconds to wait for a reply byte */
+
+typedef struct
+{
+  unsigned int  address;        /* address of the requested block */
+  unsigned char length;         /* length of the requested block */
+  unsigned char retries;
+}
+DumpRequest;
+
+static const unsigned char v24dumpcode[] = /* hex dump of v24dump.asm */
+{
+  0x54, 0x00, 0xB7, 0x77, 0x00, 0x01, 0x03, 0x07,
+  0xCD, 0x48, 0xB7, 0x2E, 0x00, 0xCD, 0x59, 0xB7,
+  0xB7, 0x28, 0x2C, 0x4F, 0xCD, 0x59, 0xB7, 0x5F,
+  0xCD, 0x59, 0xB7, 0x57, 0x83, 0x81, 0x47, 0x1A,
+  0x13, 0xCD, 0x2F, 0xB7, 0x80, 0x47, 0x0D, 0x20,
+  0xF6, 0x7D, 0x2C, 0xCD, 0x2F, 0xB7, 0x78, 0xCD,
+  0x2F, 0xB7, 0x18, 0xD9, 0x67, 0xDB, 0x0B, 0xE6,
+  0x04, 0x28, 0xFA, 0x7C, 0xD3, 0x09, 0xC9, 0x3E,
+  0x01, 0xF3, 0xD3, 0x0B, 0xDB, 0x0B, 0xFB, 0x0F,
+  0x30, 0xF5, 0x01, 0x2E, 0x09, 0x21, 0x6E, 0xB7,
+  0x3E, 0x47, 0xF3, 0xD3, 0x0D, 0x79, 0xD3, 0x0D,
+  0x0E, 0x0B, 0xED, 0xB3, 0xFB, 0xC9, 0xDB, 0x0B,
+  0x0F, 0x3F, 0x3E, 0x05, 0xF3, 0xD3, 0x0B, 0x3E,
+  0xD4, 0x1F, 0xD3, 0x0B, 0xFB, 0x07, 0x38, 0xEE,
+  0xDB, 0x09, 0xC9, 0x18, 0x04, 0x44, 0x03, 0xE1,
+  0x05, 0xEA, 0x11, 0x18
+};
+static const unsigned char v24dumprun[] = { 0x55, 0x00, 0xB7 }; /* 'U' B700 */
+static const unsigned char v24escape[]  = { 0x1B };
+
+static int            stdout_isterm;  /* log progress on standard output? */
+static int            portfd;         /* serial port file descriptor */
+static struct termios portattr;       /* serial port "terminal" settings */
+static unsigned int   nretries;       /* blocks requested again after a checksum error */
+static unsigned char  memory[0x10000]; /* contents read back from the KC */
+
+static void G_GNUC_NORETURN
+exit_usage(void)
+{
+  fputs("Usage: kcdump [-p PORT] [-s START] [-t FORMAT] BEGIN END FILE\n"
+        "Addresses are hexadecimal, and END is the address after the last byte.\n",
+        stderr);
+  exit(1);
+}
+
+static void
+change_baudrate(speed_t rate)
+{
+  cfsetispeed(&portattr, rate);
+  cfsetospeed(&portattr, rate);
+
+  if (tcsetattr(portfd, TCSADRAIN, &portattr) < 0)
+    kc_exit_error("change baudrate");
+}
+
+static void
+write_sequence(const unsigned char* data, ssize_t length)
+{
+  ssize_t written = 0;
+
+  while (written < length)
+  {
+    ssize_t rc = write(portfd, &data[written], length - written);
+    if (rc >= 0)
+      written += rc;
+    else if (errno != EINTR)
+      kc_exit_error("send sequence");
+  }
+}
+
+static void
+send_sequence(const unsigned char* data, ssize_t length)
+{
+  write_sequence(data, length);
+
+  while (tcdrain(portfd) < 0)
+  {
+    if (errno != EINTR)
+      kc_exit_error("send sequence");
+  }
+}
+
+/* Send the end request, so that the dump program returns instead of waiting
+ * for requests forever, and give up.  Two more zeros complete a request the
+ * program may have been left in the middle of.  The request may be stuck
+ * behind the handshake if the program is lost already, so it is not waited
+ * for long.
+ */
+static void G_GNUC_NORETURN
+abort_dump(void)
+{
+  const unsigned char epilog[] = { 0, 0, 0 };
+
+  write_sequence(epilog, sizeof epilog);
+  poll(0, 0, 100);
+  tcflush(portfd, TCIOFLUSH);
+
+  cfsetispeed(&portattr, BAUDRATE_NORMAL);
+  cfsetospeed(&portattr, BAUDRATE_NORMAL);
+  tcsetattr(portfd, TCSANOW, &portattr);
+  close(portfd);
+
+  fputs("Dump aborted\n", stderr);
+  exit(1);
+}
+
+/* Wait for the serial port to become ready for the given events, and
+ * return 0 if it did not within timeout milliseconds.
+ */
+static int
+wait_port(int fd, short events, int timeout)
+{
+  struct pollfd pfd = { fd, events, 0 };
+  int           rc;
+
+  while ((rc = poll(&pfd, 1, timeout)) < 0)
+  {
+    if (errno != EINTR)
+      kc_exit_error("poll serial port");
+  }
+  return rc;
+}
+
+/* Read a byte from the serial port.  If the dump program does not send
+ * anything for REPLY_TIMEOUT, it has most likely been lost, so give up.
+ */
+static unsigned int
+receive_byte(void)
+{
+  unsigned char byte;
+  ssize_t       count;
+
+  if (!wait_port(portfd, POLLIN, REPLY_TIMEOUT))
+  {
+    fputs("\rreceive byte: no reply\n", stderr);
+    abort_dump();
+  }
+  while ((count = read(portfd, &byte, 1)) < 0)
+  {
+    if (errno != EINTR)
+      kc_exit_error("receive byte");
+  }
+  if (count == 0)
+  {
+    fputs("receive byte: connection broken\n", stderr);
+    abort_dump();
+  }
+  return byte;
+}
+
+static void
+show_progress(unsigned int blocknr, const char* indicator)
+{
+  if (stdout_isterm)
+  {
+    printf("\r%.2X%s", (blocknr + 2) & 0xFF, indicator);
+    fflush(stdout);
+  }
+}
+
+static void
+send_request(const DumpRequest* request)
+{
+  const unsigned char frame[] = { request->length, request->address & 0xFF,
+                                  request->address >> 8 };
+  write_sequence(frame, sizeof frame);
+}
+
+/* Read back length bytes of KC memory starting at address begin.  The send
+ * program is requested to transmit blocks of up to 128 bytes, each followed
+ * by its block number and a checksum.  Up to DUMP_WINDOW requests are kept
+ * in flight, so that the line does not sit idle between blocks.  A block
+ * with a checksum error is requested again, up to DUMP_RETRIES times.
+ */
+static void
+dump_memory(unsigned int begin, unsigned int length)
+{
+  DumpRequest  window[DUMP_WINDOW];
+  unsigned int nsent     = 0;
+  unsigned int nreceived = 0;
+  unsigned int offset    = 0;
+
+  while (nreceived < nsent || offset < length)
+  {
+    if (nsent - nreceived < DUMP_WINDOW && offset < length)
+    {
+      DumpRequest* request = &window[nsent++ % DUMP_WINDOW];
+
+      request->address = (begin + offset) & 0xFFFFu;
+      request->length  = MIN(length - offset, 128);
+      request->retries = 0;
+
+      send_request(request);
+      offset += request->length;
+      continue;
+    }
+
+    DumpRequest*   oldest   = &window[nreceived % DUMP_WINDOW];
+    unsigned int   blocknr  = (oldest->address - begin) / 128;
+    unsigned int   checksum = oldest->length + (oldest->address & 0xFF)
+                              + (oldest->address >> 8);
+    unsigned char* block    = &memory[oldest->address];
+
+    for (unsigned int i = 0; i < oldest->length; ++i)
+    {
+      block[i] = receive_byte();
+      checksum += block[i];
+    }
+    unsigned int acknr  = receive_byte();
+    unsigned int acksum = receive_byte();
+
+    if (acknr != (nreceived & 0xFF))
+    {
+      fprintf(stderr, "\rreceive block: expected block %.2X, got %.2X\n",
+              nreceived & 0xFF, acknr);
+      abort_dump();
+    }
+    ++nreceived;
+
+    if (acksum == (checksum & 0xFF))
+    {
+      show_progress(blocknr, ">");
+      continue;
+    }
+    if (++oldest->retries > DUMP_RETRIES)
+    {
+      fprintf(stderr, "\rblock %.2X at %.4X: checksum error\n",
+              (blocknr + 2) & 0xFF, oldest->address);
+      abort_dump();
+    }
+    show_progress(blocknr, "*");
+    ++nretries;
+
+    DumpRequest* retry = &window[nsent++ % DUMP_WINDOW];
+
+    if (retry != oldest)
+      *retry = *oldest;
+
+    send_request(retry);
+  }
+
+  const unsigned char epilog[] = { 0 };
+  write_sequence(epilog, sizeof epilog);
+}
+
+/* Write the memory contents read back as a KCC file, or as a TAP file which
+ * wraps the same blocks.  The name in the file header is derived from the
+ * file name.
+ */
+static void
+write_kcfile(const char* filename, KCFileFormat format,
+             unsigned int begin, unsigned int end, unsigned int start)
+{
+  FILE*         kcfile;
+  unsigned char block[128];
+
+  memset(block, 0, sizeof block);
+  kc_filename_to_tape(KC_FORMAT_KCC, filename, block);
+
+  block[16] = (start <= 0xFFFF) ? 3 : 2;
+  block[17] = begin & 0xFF;
+  block[18] = begin >> 8;
+  block[19] = end & 0xFF;
+  block[20] = (end >> 8) & 0xFF;
+  block[21] = start & 0xFF;
+  block[22] = (start >> 8) & 0xFF;
+
+  if (filename[0] == '-' && filename[1] == '\0')
+    kcfile = stdout;
+  else
+    kcfile = fopen(filename, "wb");
+
+  if (!kcfile)
+    kc_exit_error(filename);
+
+  if (format == KC_FORMAT_TAP
+      && (fputs(KC_TAP_MAGIC, kcfile) < 0 || putc(1, kcfile) == EOF))
+    kc_exit_error(filename);
+
+  if (fwrite(block, sizeof block, 1, kcfile) == 0)
+    kc_exit_error(filename);
+
+  unsigned int nblocks = (end - begin + 127) / 128;
+
+  for (unsigned int i = 0; i < nblocks; ++i)
+  {
+    unsigned int offset = begin + 128 * i;
+
+    memset(block, 0, sizeof block);
+    memcpy(block, &memory[offset], MIN(end - offset, 128));
+
+    if (format == KC_FORMAT_TAP
+        && putc((i + 1 < nblocks) ? (i + 2) & 0xFF : 0xFF, kcfile) == EOF)
+      kc_exit_error(filename);
+
+    if (fwrite(block, sizeof block, 1, kcfile) == 0)
+      kc_exit_error(filename);
+  }
+
+  if (kcfile != stdout && fclose(kcfile) != 0)
+    kc_exit_error(filename);
+}
+
+static void
+init_serial_port(const char* portname)
+{
+  if (tcgetattr(portfd, &portattr) < 0)
+    kc_exit_error(portname);
+
+  portattr.c_iflag &= ~(BRKINT | IGNCR | ISTRIP | INLCR | ICRNL
+                        | IXON | IXOFF | PARMRK);
+  portattr.c_iflag |= INPCK | IGNBRK | IGNPAR;
+
+  portattr.c_oflag &= ~(OPOST | OCRNL | OFILL);
+
+  portattr.c_cflag &= ~(CSIZE | CSTOPB | PARENB);
+  portattr.c_cflag |= CREAD | CS8 | HUPCL | CLOCAL | CRTSCTS; /* not in POSIX */
+
+  portattr.c_lflag &= ~(ICANON | IEXTEN | ISIG | ECHO | TOSTOP);
+
+  portattr.c_cc[VMIN]  = 1;
+  portattr.c_cc[VTIME] = 0;
+
+  cfsetispeed(&portattr, BAUDRATE_NORMAL);
+  cfsetospeed(&portattr, BAUDRATE_NORMAL);
+
+  if (tcsetattr(portfd, TCSAFLUSH, &portattr) < 0 ||
+      tcgetattr(portfd, &portattr) < 0)
+    kc_exit_error(portname);
+
+  if ((portattr.c_cflag & (CSIZE | CSTOPB | PARENB | CRTSCTS)) != (CS8 | CRTSCTS)
+      || cfgetispeed(&portattr) != BAUDRATE_NORMAL
+      || cfgetospeed(&portattr) != BAUDRATE_NORMAL)
+  {
+    fprintf(stderr, "%s: serial port configuration not supported\n", portname);
+    exit(1);
+  }
+}
+
+int
+main(int argc, char** argv)
+{
+  const char*  portname = "/dev/ttyS0";
+  KCFileFormat format   = KC_FORMAT_ANY;
+  unsigned int start    = 0x10000;
+  int          c;
+
+  setlocale(LC_ALL, "");
+
+  while ((c = getopt(argc, argv, "p:s:t:?")) != -1)
+    switch (c)
+    {
+      case 'p': portname = optarg; break;
+      case 's': start    = kc_parse_arg_hex(optarg, 0, 0xFFFF); break;
+      case 't': format   = kc_parse_arg_format(optarg); break;
+      case '?': exit_usage();
+      default:  abort();
+    }
+
+  if (argc - optind != 3)
+    exit_usage();
+
+  unsigned int begin    = kc_parse_arg_hex(argv[optind], 0, 0xFFFF);
+  unsigned int end      = kc_parse_arg_hex(argv[optind + 1], begin + 1, 0x10000);
+  const char*  filename = argv[optind + 2];
+
+  if (format == KC_FORMAT_ANY)
+    format = kc_format_from_filename(filename);
+
+  if (format == KC_FORMAT_ANY)
+    format = KC_FORMAT_KCC;
+
+  if (format != KC_FORMAT_KCC && format != KC_FORMAT_TAP)
+  {
+    fprintf(stderr, "%s: only KCC and TAP files can be written\n", filename);
+    exit(1);
+  }
+  stdout_isterm = isatty(STDOUT_FILENO) && strcmp(filename, "-") != 0;
+
+  portfd = open(portname, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (portfd < 0)
+    kc_exit_error(portname);
+
+  init_serial_port(portname);
+
+  int flags = fcntl(portfd, F_GETFL, 0);
+  if (flags < 0 || fcntl(portfd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+    kc_exit_error(portname);
+
+  if (stdout_isterm)
+  {
+    printf("Using serial port %s\n%.4X %.4X", portname, begin, end);
+
+    if (start <= 0xFFFF)
+      printf(" %.4X", start);
+
+    fputs("\n01>", stdout);
+    fflush(stdout);
+  }
+  send_sequence(v24escape, sizeof v24escape);
+  send_sequence(v24dumpcode, sizeof v24dumpcode);
+  send_sequence(v24escape, sizeof v24escape);
+  send_sequence(v24dumprun, sizeof v24dumprun);
+  change_baudrate(BAUDRATE_BOOST);
+
+  dump_memory(begin, end - begin);
+
+  change_baudrate(BAUDRATE_NORMAL);
+
+  if (close(portfd) < 0)
+    kc_exit_error(portname);
+
+  if (stdout_isterm)
+    puts("\rFF>");
+
+  write_kcfile(filename, format, begin, end, start);
+
+  if (nretries > 0)
+    fprintf(stderr, "%u blocks requested again after checksum errors\n", nretries);
+
+  return 0;
+}
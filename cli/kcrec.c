@@ -17,17 +17,24 @@
 
 #include <build/config.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
 #include <locale.h>
+#include <math.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <wchar.h>
 #include <alsa/asoundlib.h>
 #include <libkc/libkc.h>
+#include <cli/kcrec.h>
 
 enum BitLength
 {
@@ -36,22 +43,147 @@ enum BitLength
   BIT_T = 2  //  600 Hz
 };
 
+enum { MAX_SPEED = 4 }; // fastest supported tape playback speed factor
+enum { MAX_DECIMATION = 8 }; // keeps the decimated sample sums within int32_t
+enum { LEADIN_THRESHOLD = 2 * 24 }; // minimum lead-in length in half periods
+
+const char *const block_status_names[] =
+{
+  "ok", "timeout", "decode", "sync", "sync-loss", "checksum"
+};
+
+static const char *const block_status_messages[] =
+{
+  "", "Block sequence timeout", "Analog signal decoding error",
+  "Analog signal synchronization error", "Analog signal synchronization loss",
+  "Block checksum error"
+};
+
+enum { HISTORY_SECONDS = 8 }; // length of the sample history for salvage dumps
+
+/* A decoded block kept for later, along with its statistics.
+ */
+typedef struct
+{
+  int           status;
+  unsigned int  source;
+  unsigned int  tapespeed;
+  DecodeStats   stats;
+  uint8_t       data[128];
+}
+BlockResult;
+
+/* Ring buffer of captured periods in daemon mode.  A capture thread keeps
+ * filling it regardless of the decoder, so that the decoder may fall behind
+ * for a while without losing input, and the last seconds of the capture are
+ * kept at any time.
+ */
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  pthread_t       thread;
+  int16_t*        samples;
+  unsigned int    n_periods;   // capacity in periods
+  unsigned int    period_frames;
+  unsigned int    n_channels;
+  uint64_t        head;        // number of periods captured
+  uint64_t        tail;        // number of periods passed on to the decoder
+}
+CaptureRing;
+
+/* Format of the input file, as handed over to worker threads.
+ */
+typedef struct
+{
+  const char*   name;
+  off_t         data;
+  uint64_t      frames;
+  unsigned int  periodsize;
+  unsigned int  samplerate;
+  unsigned int  n_channels;
+  unsigned int  decimation;
+  unsigned int  histsize;
+}
+InputFormat;
+
+/* A segment of the input file, decoded by a worker thread.
+ */
+typedef struct
+{
+  InputFormat   format;
+  Stream        stream;
+  pthread_t     thread;
+  BlockResult*  results;
+  size_t        n_results;
+  size_t        size;
+}
+Segment;
+
 static snd_pcm_t*        audio      = 0;
 static snd_output_t*     output     = 0;
-static int16_t*          periodbuf;
-static snd_pcm_uframes_t periodsize = 0;
-static snd_pcm_uframes_t periodpos;
-static unsigned int      samplerate = 48000;
-static unsigned int      channel    = 0;
-static unsigned int      n_channels;
-static unsigned int      sync_period;
-static int               stdout_isterm; // log progress on standard output?
-
-static void
-exit_usage(void)
+static unsigned int      gap_level  = 131; // silence threshold for file input (RMS)
+static FILE*             tracefile;      // edge trace output
+static const char*       tracefilename;
+static uint64_t          tracemark  = 0; // end of the traced data in half frames
+static unsigned int      n_decoders = 1;
+unsigned int             n_jobs     = 1; // number of decoding threads
+static int               parallel;       // replay results of parallel decoding?
+static BlockResult*      results;
+static size_t            n_results;
+static size_t            next_result;
+int                      diversity;      // decode and combine both channels?
+static unsigned int      hysteresis = 0; // in 1/256 of the peak level
+static unsigned int      workrate   = 44100;
+unsigned int             channel    = 0;
+static unsigned int      speed_factor = 0; // tape playback speed, or 0 to detect
+int                      stdout_isterm; // log progress on standard output?
+static int               stats_json;    // write decode statistics as JSON?
+static int               extract_all;   // extract every file on the recording?
+const char*              extract_dir = ".";
+const char*              batchname;     // catalog of batch mode
+const char*              mergename;     // output file of merge mode
+static const char*       salvage_dir;   // where to dump the samples of failed blocks
+static int               meter;         // show the live signal meter?
+static double            meter_time;    // wall-clock time of the last meter update
+static unsigned int      preroll;       // length of the daemon mode ring buffer in seconds
+static CaptureRing       ring;
+static int               run_complete;
+static DecodeStats       runstats;
+static unsigned int      n_status[1 - BLOCK_CHECKSUM]; // indexed by -BlockStatus
+static double            min_margin      = HUGE_VAL; // whole run, relative to sync period
+static unsigned int      min_sync_period = UINT_MAX;
+static unsigned int      max_sync_period;
+static uint64_t          sum_sync_period;
+
+// The input and its format.  In batch mode, each worker thread decodes
+// recordings of its own, hence these are thread-local.
+static __thread snd_pcm_uframes_t periodsize = 0;
+__thread Stream                   stream;
+__thread FILE*                    infile;        // input file instead of capture device
+static __thread const char*       infilename;
+static __thread int               infile_trace;  // input is an edge trace?
+static __thread off_t             infile_data;   // offset of the WAV sample data
+static __thread uint64_t          infile_frames; // length of the WAV sample data
+static __thread unsigned int      samplerate = 48000;
+__thread unsigned int             n_channels;
+static __thread unsigned int      decimation = 1;
+static __thread unsigned int      histsize;
+__thread BlockHealth              health;
+
+/* Print the usage text and exit.  Asking for it with -? is not an error.
+ */
+static void G_GNUC_NORETURN
+exit_usage(int status)
 {
-  fputs("Usage: kcrec [-c CHANNEL] [-d DEVICE] [-r RATE] [-t FORMAT] [-v] FILE...\n", stderr);
-  exit(optopt != 0);
+  fputs("Usage: kcrec [-b | -c CHANNEL] [-d DEVICE | -i INPUT] [-e TRACE]"
+        " [-g LEVEL] [-H HYSTERESIS] [-j JOBS] [--meter] [-r RATE]"
+        " [--salvage=DIRECTORY] [--stats=json] [-t FORMAT] [-v] [-w RATE]"
+        " [-x SPEED] {{-a | --daemon=SECONDS} [DIRECTORY]"
+        " | --batch=CATALOG TREE... | --merge=FILE INPUT... | FILE...}\n"
+        "The edge detection options -g, -H and -w do not apply to an edge trace input.\n",
+        stderr);
+  exit(status);
 }
 
 static void
@@ -61,6 +193,33 @@ exit_snd_error(int rc, const char* what)
   exit(1);
 }
 
+static int
+parse_arg_stats(const char* arg)
+{
+  if (strcmp(arg, "json") != 0)
+  {
+    fprintf(stderr, "Unknown statistics format \"%s\"\n", arg);
+    exit(1);
+  }
+  return 1;
+}
+
+/* Parse the tape speed factor, which is either 0 for automatic detection
+ * or a power of two up to MAX_SPEED.
+ */
+static unsigned int
+parse_arg_speed(const char* arg)
+{
+  unsigned int factor = kc_parse_arg_int(arg, 0, MAX_SPEED);
+
+  if ((factor & (factor - 1)) != 0)
+  {
+    fprintf(stderr, "%s: speed factor must be a power of two\n", arg);
+    exit(1);
+  }
+  return factor;
+}
+
 static void
 init_audio(const char* devname)
 {
@@ -135,406 +294,2470 @@ init_audio(const char* devname)
     exit_snd_error(rc, "preparing device");
 }
 
-static int
-read_frame(void)
+static uint32_t
+get_le(const uint8_t* bytes, int n)
 {
-  if (periodpos >= periodsize)
-  {
-    snd_pcm_uframes_t nread = 0;
+  uint32_t value = 0;
 
-    while (nread < periodsize)
-    {
-      snd_pcm_sframes_t rc = snd_pcm_readi(audio, &periodbuf[n_channels * nread],
-                                           periodsize - nread);
-      if (rc < 0)
-        rc = snd_pcm_recover(audio, rc, 0);
-      if (rc >= 0)
-        nread += rc;
-      else if (rc != -EINTR && rc != -EAGAIN)
-        exit_snd_error(rc, "reading sample data");
-    }
-    periodpos = 0;
-  }
-  return periodbuf[n_channels * (periodpos++) + channel];
+  while (n > 0)
+    value = (value << 8) | bytes[--n];
+
+  return value;
 }
 
-static int
-peek_last_frame(void)
+static void
+exit_input_error(const char* what)
 {
-  return periodbuf[n_channels * (periodpos - 1) + channel];
+  fprintf(stderr, "%s: %s\n", infilename, what);
+  exit(1);
 }
 
-static unsigned int
-wait_for_edge(void)
+/* Open the input file, which may either be an edge trace written by kcrec,
+ * or a WAV file with 16-bit PCM samples.  Take the sample rate and number of
+ * channels from its header.  Return 0 on success, or an error message.
+ */
+const char*
+open_input(const char* filename)
 {
-  unsigned int countdown = samplerate / 128 + 1;
+  uint8_t header[16]; // large enough for the WAV format chunk
 
-  int32_t left;
-  int32_t right = peek_last_frame();
+  infilename = filename;
 
-  for (unsigned int i = 0; i < countdown; ++i)
+  if (filename[0] == '-' && filename[1] == '\0')
   {
-    left  = right;
-    right = read_frame();
+    infile     = stdin;
+    infilename = "standard input";
+  }
+  else
+    if (!(infile = fopen(filename, "rb")))
+      return strerror(errno);
 
-    // Note: assumes two's complement
-    if ((left ^ right) < 0)
-    {
-      static unsigned int last_offset = 0;
+  infile_trace = 0;
 
-      unsigned int offset = (((left + right) ^ right) < 0) ? 1 : 0;
-      unsigned int delta  = 2 * i + 2 + offset - last_offset;
+  if (fread(header, 12, 1, infile) == 0)
+    return "Not a WAV file or edge trace";
 
-      last_offset = offset;
-      return delta;
-    }
-  }
-  return 2 * countdown; // countdown expired
-}
+  if (memcmp(header, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0)
+  {
+    if (fread(&header[12], TRACE_HEADER_LEN - 12, 1, infile) == 0)
+      return "Truncated edge trace";
 
-static unsigned int
-sync_block(void)
-{
-  enum { LEADIN_THRESHOLD = 2 * 24 };
+    infile_trace = 1;
+    samplerate   = get_le(&header[8], 4);
+    n_channels   = header[12];
+    periodsize   = MAX(1u, samplerate / 20); // read periods of 50 ms
 
-  unsigned long min_period = samplerate / 8192;
-  unsigned long max_period = samplerate / 256;
+    if (samplerate == 0 || n_channels < 1 || n_channels > G_N_ELEMENTS(stream.infile_edges))
+      return "Invalid edge trace header";
 
-  unsigned long timer = 4ul * samplerate; // about 2 seconds
-  unsigned long sum;
-  unsigned long count;
-  unsigned long period;
+    return 0;
+  }
+  if (memcmp(header, "RIFF", 4) != 0 || memcmp(&header[8], "WAVE", 4) != 0)
+    return "Not a WAV file or edge trace";
 
-  for (count = 0, sum = 0;; ++count, sum += period)
+  n_channels = 0;
+
+  // Walk the chunk list up to the start of the sample data.
+  for (;;)
   {
-    period = wait_for_edge();
+    if (fread(header, 8, 1, infile) == 0)
+      return "No sample data in WAV file";
 
-    // Virtual band-pass filter
-    if (period > min_period && period < max_period)
+    uint32_t size = get_le(&header[4], 4);
+
+    if (memcmp(header, "data", 4) == 0)
     {
-      unsigned long ex = count * period; // extrapolation
+      // Streaming writers leave the size open as 0 or FFFFFFFFh.
+      infile_data   = ftello(infile);
+      infile_frames = (size == 0 || size == UINT32_MAX) ? UINT64_MAX : size;
+      break;
+    }
 
-      // Period within +/-25% of the average?
-      if (4 * ex >= 3 * sum && 4 * ex <= 5 * sum)
-        continue;
+    if (memcmp(header, "fmt ", 4) == 0 && size >= 16)
+    {
+      if (fread(header, 16, 1, infile) == 0)
+        return "Truncated WAV file";
 
-      // Minimum duration passed and period within +/-33% of 2 * average?
-      if (count > LEADIN_THRESHOLD && 3 * ex > 4 * sum && 3 * ex < 8 * sum)
-      {
-        period = wait_for_edge();
-        unsigned long average = (sum + count / 2) / count;
+      if (get_le(&header[0], 2) != 1 || get_le(&header[14], 2) != 16)
+        return "Unsupported WAV sample format";
 
-        // Second half period within +/-25% of 2 * average?
-        if (2 * period > 3 * average && 2 * period < 5 * average)
-          return average;
-      }
+      n_channels = get_le(&header[2], 2);
+      samplerate = get_le(&header[4], 4);
+      size -= 16;
     }
-    if (timer <= sum)
-      return 0;
+    if (fseek(infile, size + (size & 1), SEEK_CUR) < 0)
+      return strerror(errno);
+  }
+  if (n_channels == 0 || samplerate == 0)
+    return "Invalid WAV format chunk";
 
-    timer -= sum;
-    sum   = 0;
-    count = 0;
+  infile_frames /= n_channels * sizeof(int16_t);
+  periodsize     = MAX(1u, samplerate / 20); // read periods of 50 ms
+
+  return 0;
+}
+
+/* Read one period of little-endian samples from the WAV input file.  Pad an
+ * incomplete period with silence.  Return 0 at the end of the sample data,
+ * so that any chunks following it are not taken for samples.
+ */
+static int
+read_file_period(Stream* s)
+{
+  int16_t* periodbuf = s->periodbuf;
+  size_t   count     = MIN(periodsize, s->filerest);
+  size_t   nread     = fread(periodbuf, n_channels * sizeof periodbuf[0], count, s->file);
+
+  if (nread < count && ferror(s->file))
+    kc_exit_error(infilename);
+
+  s->filerest -= nread;
+
+  for (size_t i = 0; i < nread * n_channels; ++i)
+  {
+    const uint8_t* bytes = (const uint8_t*)&periodbuf[i];
+
+    periodbuf[i] = (int16_t)get_le(bytes, 2);
   }
+  memset(&periodbuf[nread * n_channels], 0,
+         (periodsize - nread) * n_channels * sizeof periodbuf[0]);
+
+  if (nread > 0)
+    s->endpadding += periodsize - nread;
+
+  return (nread > 0);
 }
 
-static unsigned int
-record_bit(void)
+/* Check whether the period just read from the input file is silent on all
+ * decoded channels.  The AC energy of short strides is compared against the
+ * gap threshold, so that neither a DC offset nor the onset of a lead-in tone
+ * in the middle of the period can be mistaken for silence or signal.
+ */
+static int
+period_is_silent(const Stream* s)
 {
-  unsigned int norm  = sync_period;
-  unsigned int first = wait_for_edge();
+  enum { STRIDE = 256 };
 
-  if (3 * first > norm && 3 * first < 8 * norm)
+  int64_t level = gap_level;
+
+  for (unsigned int d = 0; d < n_decoders; ++d)
   {
-    unsigned int second = wait_for_edge();
+    const int16_t* in = &s->periodbuf[s->decoders[d].channel];
 
-    // The last oscillation at the end of every block is missing its second
-    // half period: KC bug!  Thus, let overlong periods pass.
-    if (3 * second > norm)
+    for (unsigned int pos = 0; pos < periodsize; pos += STRIDE)
     {
-      if (4 * second < 3 * norm) // below norm/2 +50%?
-      {
-        if (first < norm)
-          return BIT_0;
-      }
-      else if (3 * second > 4 * norm) // above 2*norm - 33%?
-      {
-        if (first > norm)
-          return BIT_T;
-      }
-      else
+      int64_t n     = MIN(STRIDE, periodsize - pos);
+      int64_t sum   = 0;
+      int64_t sumsq = 0;
+
+      for (unsigned int i = pos; i < pos + n; ++i)
       {
-        if (3 * first > 2 * norm && 3 * first < 5 * norm) // within norm -33%/+66%?
-          return BIT_1;
+        int32_t x = in[n_channels * i];
+
+        sum   += x;
+        sumsq += x * x;
       }
+      if (n * sumsq - sum * sum >= n * n * level * level)
+        return 0;
     }
   }
-  fputs("Analog signal decoding error\n", stderr);
-  exit(1);
+  return 1;
 }
 
-static unsigned int
-record_byte(void)
+/* Capture one period from the sound device.
+ */
+static void
+capture_period(int16_t* buf, snd_pcm_uframes_t frames, unsigned int channels)
 {
-  unsigned int byte = 0;
+  snd_pcm_uframes_t nread = 0;
 
-  for (int i = 0; i < 8; ++i)
+  while (nread < frames)
   {
-    unsigned int bit = record_bit();
-
-    if (bit > BIT_1)
-    {
-      fputs("Analog signal synchronization error\n", stderr);
-      exit(1);
-    }
-    byte = (byte >> 1) | (bit << 7);
+    snd_pcm_sframes_t rc = snd_pcm_readi(audio, &buf[channels * nread], frames - nread);
+
+    if (rc < 0)
+      rc = snd_pcm_recover(audio, rc, 0);
+    if (rc >= 0)
+      nread += rc;
+    else if (rc != -EINTR && rc != -EAGAIN)
+      exit_snd_error(rc, "reading sample data");
   }
+}
+
+static void*
+capture_loop(void* arg)
+{
+  CaptureRing* r    = arg;
+  size_t       size = (size_t)r->period_frames * r->n_channels;
+  int16_t*     buf  = malloc(size * sizeof buf[0]);
+
+  if (!buf)
+    kc_exit_error("capture buffer");
 
-  if (record_bit() != BIT_T)
+  for (;;)
   {
-    fputs("Analog signal synchronization loss\n", stderr);
-    exit(1);
+    capture_period(buf, r->period_frames, r->n_channels);
+
+    pthread_mutex_lock(&r->lock);
+    memcpy(&r->samples[(r->head % r->n_periods) * size], buf, size * sizeof buf[0]);
+    ++r->head;
+    pthread_cond_signal(&r->cond);
+    pthread_mutex_unlock(&r->lock);
   }
-  return byte;
+  return 0;
 }
 
-static int
-record_block(unsigned char* data)
+/* Set up the ring buffer for the given number of seconds of capture, and
+ * start the capture thread.
+ */
+static void
+start_capture(unsigned int seconds)
 {
-  sync_period = sync_block();
+  ring.period_frames = periodsize;
+  ring.n_channels    = n_channels;
+  ring.n_periods     = MAX(2u, (uint64_t)seconds * samplerate / periodsize + 1);
+  ring.samples       = calloc((size_t)ring.n_periods * periodsize * n_channels, sizeof(int16_t));
 
-  if (sync_period == 0)
-    return -1; // timeout
+  if (!ring.samples)
+    kc_exit_error("ring buffer");
 
-  int blocknr = record_byte();
-  unsigned int checksum = 0;
+  pthread_mutex_init(&ring.lock, 0);
+  pthread_cond_init(&ring.cond, 0);
 
-  for (int i = 0; i < 128; ++i)
-  {
-    unsigned int byte = record_byte();
-    data[i] = byte;
-    checksum += byte;
-  }
-  if ((checksum & 0xFF) != record_byte())
+  if (pthread_create(&ring.thread, 0, &capture_loop, &ring) != 0)
   {
-    fputs("Block checksum error\n", stderr);
+    fputs("Failed to create capture thread\n", stderr);
     exit(1);
   }
-  return blocknr;
 }
 
+/* Take the next period off the ring buffer, waiting for it if need be.  If
+ * the decoder has fallen behind by more than the whole ring, skip ahead and
+ * account for the lost time.
+ */
 static void
-record_kcfile(const char* filename, KCFileFormat format)
+read_ring_period(Stream* s)
 {
-  FILE*        kcfile;
-  unsigned int length;
-  int          blocknr;
-  int          nblocks = INT_MAX / 128;
-  wchar_t      name[12];
-  uint8_t      block[128];
+  size_t size = (size_t)periodsize * n_channels;
 
-  if (format == KC_FORMAT_ANY)
+  pthread_mutex_lock(&ring.lock);
+
+  while (ring.tail == ring.head)
+    pthread_cond_wait(&ring.cond, &ring.lock);
+
+  if (ring.head - ring.tail > ring.n_periods - 1)
   {
-    format = kc_format_from_filename(filename);
+    uint64_t lost = ring.head - ring.tail - (ring.n_periods - 1);
 
-    if (format == KC_FORMAT_ANY)
-      format = KC_FORMAT_TAP;
+    fprintf(stderr, "Decoder overrun, %llu periods lost\n", (unsigned long long)lost);
+    ring.tail   += lost;
+    s->scantime += 2 * lost * periodsize;
   }
+  memcpy(s->periodbuf, &ring.samples[(ring.tail % ring.n_periods) * size],
+         size * sizeof s->periodbuf[0]);
+  ++ring.tail;
 
-  if (filename[0] == '-' && filename[1] == '\0')
-    kcfile = stdout;
-  else
-    if (!(kcfile = fopen(filename, "wb")))
-      kc_exit_error(filename);
+  pthread_mutex_unlock(&ring.lock);
+}
 
-  if (KC_BASE_FORMAT(format) == KC_FORMAT_TAP)
-  {
-    // For TAP files, record blocks in whatever order they come in.
-    do
-      blocknr = record_block(block);
-    while (blocknr < 0);
+/* Read the next period of sample data.  Return 0 at the end of the input.
+ */
+static int
+read_period(Stream* s)
+{
+  if (s->file)
+    return read_file_period(s);
 
-    if (stdout_isterm)
-    {
-      printf("\r%.2X>", blocknr);
-      fflush(stdout);
-    }
-    if (fputs(KC_TAP_MAGIC, kcfile) < 0
-        || putc(blocknr, kcfile) == EOF
-        || fwrite(block, sizeof block, 1, kcfile) == 0)
-      kc_exit_error(filename);
-  }
+  if (preroll > 0)
+    read_ring_period(s);
   else
-  {
-    while ((blocknr = record_block(block)) != 1)
-      if (blocknr >= 0 && stdout_isterm)
-      {
-        printf("%.2X*\n", blocknr);
-        fflush(stdout);
-      }
+    capture_period(s->periodbuf, periodsize, n_channels);
 
-    if (stdout_isterm)
-    {
-      for (int i = 0; i < 11; ++i)
-        name[i] = kc_to_wide_char(block[i]);
-      name[11] = L'\0';
+  return 1;
+}
 
-      printf("%ls", name);
-    }
+/* Remove the DC offset from the samples of one period.  The offset is
+ * estimated from the period average and smoothed over a few periods.  To
+ * avoid steps at period boundaries, the subtracted offset is ramped linearly
+ * from the previous to the new estimate.  Return the peak amplitude.
+ */
+static unsigned int
+remove_dc(Decoder* dec, int32_t* restrict samples, unsigned int count)
+{
+  enum { DC_FRAC = 12, DC_SMOOTH = 2 };
 
-    if (KC_BASE_FORMAT(format) == KC_FORMAT_SSS)
-    {
-      unsigned int sig = block[0];
+  int64_t sum = 0;
 
-      if (((sig & 0xFB) == 0xD3 || (sig & 0xFE) == 0xD4) && block[1] == sig && block[2] == sig)
-      {
-        length  = block[11] | (unsigned)block[12] << 8;
-        nblocks = (14 + 127 + length) / 128;
-      }
-      else
-      {
-        fputs("\nInvalid KC-BASIC start block\n", stderr);
-        exit(1);
-      }
+  for (unsigned int i = 0; i < count; ++i)
+    sum += samples[i];
 
-      if (fwrite(&block[11], MIN(sizeof block - 11, 3 + length), 1, kcfile) == 0)
-        kc_exit_error(filename);
-    }
-    else // KC_BASE_FORMAT(format) == KC_FORMAT_KCC
-    {
-      unsigned int load = block[17] | (unsigned)block[18] << 8;
-      unsigned int end  = block[19] | (unsigned)block[20] << 8;
+  int32_t average = (sum << DC_FRAC) / count;
+  int32_t dc      = dec->dc_offset + (((int64_t)average - dec->dc_offset) >> DC_SMOOTH);
+  int32_t step    = ((int64_t)dc - dec->dc_offset) / (int32_t)count;
+  int32_t base    = dec->dc_offset + (1 << (DC_FRAC - 1));
 
-      if (stdout_isterm)
-        printf(" %.4X %.4X", load, end);
+  dec->dc_offset = dc;
 
-      int nargs = block[16];
+  int32_t peak = 0;
 
-      if (nargs >= 3)
-      {
-        unsigned int start = block[21] | (unsigned)block[22] << 8;
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    int32_t x = samples[i] - ((base + (int32_t)i * step) >> DC_FRAC);
+    int32_t a = (x < 0) ? -x : x;
 
-        if (stdout_isterm)
-          printf(" %.4X", start);
-      }
-      if (nargs < 2 || nargs > 10 || load >= end)
-      {
-        fputs("\nInvalid KCC start block\n", stderr);
-        exit(1);
-      }
-      nblocks = (128 + 127 + end - load) / 128;
+    samples[i] = x;
+    peak = (a > peak) ? a : peak;
+  }
+  return peak;
+}
 
-      if (fwrite(block, sizeof block, 1, kcfile) == 0)
-        kc_exit_error(filename);
-    }
+/* Extract the decoder's channel from the interleaved period buffer and reduce
+ * the sample rate by the decimation factor.  Each output sample is the sum of
+ * a group of consecutive input frames, i.e. a boxcar low-pass filter evaluated
+ * at the decimated rate only.  Groups may straddle period boundaries.  Return
+ * the number of output samples.
+ */
+static unsigned int
+decimate(Decoder* dec, const int16_t* restrict in, unsigned int nframes,
+         int32_t* restrict out)
+{
+  unsigned int stride = n_channels;
+  unsigned int ratio  = decimation;
+  unsigned int count  = 0;
+  unsigned int i      = 0;
 
-    if (stdout_isterm)
-      putchar('\n');
-  }
+  in += dec->channel;
 
-  for (int i = 2; i <= nblocks; ++i)
+  if (ratio == 1)
   {
-    blocknr = record_block(block);
-
-    if (blocknr < 0)
-      break;
+    for (; i < nframes; ++i)
+      out[i] = in[stride * i];
 
-    if (KC_BASE_FORMAT(format) != KC_FORMAT_TAP)
-    {
-      int expected = (KC_BASE_FORMAT(format) == KC_FORMAT_SSS || i < nblocks) ? i & 0xFF : 0xFF;
+    return nframes;
+  }
 
-      if (blocknr != expected)
-      {
-        if (stdout_isterm)
-          printf("\r%.2X*\n", blocknr);
+  // Complete the group left over from the previous period.
+  if (dec->decim_phase > 0)
+  {
+    for (; i < nframes && dec->decim_phase < ratio; ++i, ++dec->decim_phase)
+      dec->decim_acc += in[stride * i];
 
-        fputs("Block sequence error\n", stderr);
-        exit(1);
-      }
-    }
-    if (stdout_isterm)
-    {
-      printf("\r%.2X>", blocknr);
-      fflush(stdout);
-    }
+    if (dec->decim_phase < ratio)
+      return 0;
 
-    if (KC_BASE_FORMAT(format) == KC_FORMAT_TAP && putc(blocknr, kcfile) == EOF)
-      kc_exit_error(filename);
+    out[count++] = dec->decim_acc;
+  }
+  unsigned int ngroups = (nframes - i) / ratio;
 
-    size_t writesize = sizeof block;
+  for (unsigned int k = 0; k < ngroups; ++k)
+  {
+    const int16_t* group = &in[stride * (i + ratio * k)];
+    int32_t        sum   = 0;
 
-    if (KC_BASE_FORMAT(format) == KC_FORMAT_SSS && blocknr == nblocks)
-      writesize = sizeof block + 14 + length - nblocks * sizeof block;
+    for (unsigned int j = 0; j < ratio; ++j)
+      sum += group[stride * j];
 
-    if (fwrite(block, writesize, 1, kcfile) == 0)
-      kc_exit_error(filename);
+    out[count + k] = sum;
   }
+  count += ngroups;
+  i     += ngroups * ratio;
 
-  if (stdout_isterm)
-    putchar('\n');
+  dec->decim_acc   = 0;
+  dec->decim_phase = 0;
 
-  if (kcfile != stdout && fclose(kcfile) != 0)
-    kc_exit_error(filename);
+  for (; i < nframes; ++i, ++dec->decim_phase)
+    dec->decim_acc += in[stride * i];
 
-  if (blocknr < 0 && KC_BASE_FORMAT(format) != KC_FORMAT_TAP)
-  {
-    fputs("Block sequence timeout\n", stderr);
+  return count;
+}
+
+static void
+put_varint(uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    putc((value & 0x7F) | 0x80, tracefile);
+    value >>= 7;
+  }
+  putc(value, tracefile);
+}
+
+static void
+trace_edge(Decoder* dec, uint64_t time)
+{
+  put_varint(1 + (dec - dec->stream->decoders) + n_decoders * (time - dec->tracetime));
+  dec->tracetime = time;
+}
+
+static void
+open_trace(const char* filename)
+{
+  uint8_t header[TRACE_HEADER_LEN];
+
+  memcpy(header, TRACE_MAGIC, TRACE_MAGIC_LEN);
+
+  for (int i = 0; i < 4; ++i)
+    header[TRACE_MAGIC_LEN + i] = samplerate >> (8 * i);
+
+  header[TRACE_MAGIC_LEN + 4] = n_decoders;
+
+  if (!(tracefile = fopen(filename, "wb"))
+      || fwrite(header, sizeof header, 1, tracefile) == 0)
+    kc_exit_error(filename);
+
+  tracefilename = filename;
+}
+
+/* Make room for count more edges in the decoder's queue.  Edges already
+ * taken are discarded.  The queue grows as needed, as one decoder may wait
+ * for a lead-in while the other one is still busy.
+ */
+static void
+reserve_edges(Decoder* dec, unsigned int count)
+{
+  if (dec->edgecount + count <= dec->edgesize)
+    return;
+
+  unsigned int remaining = dec->edgecount - dec->edgepos;
+
+  if (dec->edgepos > 0)
+  {
+    memmove(dec->edges, &dec->edges[dec->edgepos], remaining * sizeof dec->edges[0]);
+    dec->edgecount = remaining;
+    dec->edgepos   = 0;
+  }
+  if (remaining + count > dec->edgesize)
+  {
+    unsigned int size = MAX(2 * dec->edgesize, remaining + count);
+
+    if (!(dec->edges = realloc(dec->edges, size * sizeof dec->edges[0])))
+      kc_exit_error("edge queue");
+
+    dec->edgesize = size;
+  }
+}
+
+/* Locate the zero crossings in count decimated samples starting at time,
+ * and append them to the decoder's edge queue.  The time stamp of each edge
+ * is stored in units of half frames at the capture rate.  The position of the
+ * crossing between two samples is interpolated linearly, so that edge timing
+ * keeps sub-sample precision after decimation.  Return the end time.
+ */
+static uint64_t
+scan_channel(Decoder* dec, int32_t* restrict samples, unsigned int count, uint64_t time)
+{
+  int32_t threshold = 0;
+
+  if (hysteresis > 0 && count > 0)
+  {
+    unsigned int peak = remove_dc(dec, samples, count);
+
+    dec->peak_level = (3 * dec->peak_level + peak + 3) / 4;
+    threshold = (dec->peak_level * hysteresis) >> 8;
+  }
+  reserve_edges(dec, count);
+
+  unsigned int step  = 2 * decimation;
+  int32_t      left  = dec->last_sample;
+  int32_t      state = dec->schmitt_state;
+  uint64_t     cross = dec->last_crossing;
+  uint64_t*    edges = &dec->edges[dec->edgecount];
+  unsigned int n     = 0;
+
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    int32_t right = samples[i];
+
+    // Note: assumes two's complement
+    if ((left ^ right) < 0)
+    {
+      uint32_t l = (left  < 0) ? -left  : left;
+      uint32_t r = (right < 0) ? -right : right;
+
+      cross = time + (2 * step * l + l + r) / (2 * (l + r));
+    }
+    time += step;
+
+    // Schmitt trigger: report the most recent zero crossing once the signal
+    // has moved past the threshold on the opposite side.
+    if ((state ^ right) < 0 && (right >= threshold || right < -threshold))
+    {
+      state = right;
+      edges[n++] = cross;
+    }
+    left = right;
+  }
+  if (tracefile)
+    for (unsigned int i = 0; i < n; ++i)
+      trace_edge(dec, edges[i]);
+
+  dec->edgecount    += n;
+  dec->last_sample   = left;
+  dec->schmitt_state = state;
+  dec->last_crossing = cross;
+
+  return time;
+}
+
+static int
+get_varint(uint64_t* value)
+{
+  uint64_t v = 0;
+
+  for (int shift = 0; shift < 64; shift += 7)
+  {
+    int c = getc(stream.file);
+
+    if (c == EOF)
+    {
+      if (ferror(stream.file))
+        kc_exit_error(infilename);
+      if (shift > 0)
+        exit_input_error("Truncated edge trace");
+      return 0;
+    }
+    v |= (uint64_t)(c & 0x7F) << shift;
+
+    if ((c & 0x80) == 0)
+    {
+      *value = v;
+      return 1;
+    }
+  }
+  exit_input_error("Corrupt edge trace");
+  return 0;
+}
+
+/* Read the edges of one capture period from the input trace, and pass them
+ * on to the decoders of the respective channels.  Return 0 at the end of the
+ * trace.
+ */
+static int
+read_trace_period(Stream* s)
+{
+  uint64_t value;
+
+  while (get_varint(&value))
+  {
+    if (value == 0)
+    {
+      if (!get_varint(&value))
+        exit_input_error("Truncated edge trace");
+
+      s->scantime += value;
+      return 1;
+    }
+    unsigned int ch   = (value - 1) % n_channels;
+    uint64_t     time = (s->infile_edges[ch] += (value - 1) / n_channels);
+
+    for (unsigned int i = 0; i < n_decoders; ++i)
+    {
+      Decoder* dec = &s->decoders[i];
+
+      if (dec->channel == ch)
+      {
+        reserve_edges(dec, 1);
+        dec->edges[dec->edgecount++] = time;
+
+        if (tracefile)
+          trace_edge(dec, time);
+      }
+    }
+  }
+  return 0;
+}
+
+/* Past the end of the input, continue with silence to let pending timeouts
+ * expire.  Once the decoders have taken all edges, they report a timeout.
+ */
+static void
+pad_input(Stream* s)
+{
+  s->scantime   += 2 * periodsize;
+  s->endpadding += periodsize;
+}
+
+/* Keep a copy of the period just read for salvage dumps.
+ */
+static void
+keep_history(Stream* s)
+{
+  if (!s->history)
+    return;
+
+  size_t size = (size_t)periodsize * n_channels;
+  size_t slot = s->n_history++ % s->historysize;
+
+  memcpy(&s->history[slot * size], s->periodbuf, size * sizeof s->periodbuf[0]);
+  s->historytime[slot] = s->scantime;
+}
+
+static double
+monotonic_time(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+    kc_exit_error("clock");
+
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Measure the level and clipping of each decoded channel of the period just
+ * read, and update the signal meter a few times per second.  The meter line
+ * is drawn on the terminal to the right of the block progress.  With sync
+ * lock, it shows the speed factor and sync period.  The histogram of the
+ * decision margins goes from no margin at the left to a quarter of the sync
+ * period and above at the right.
+ */
+static void
+update_meter(Stream* s)
+{
+  static const char levels[] = " .:-=+*#";
+
+  for (unsigned int d = 0; d < n_decoders; ++d)
+  {
+    Decoder*       dec  = &s->decoders[d];
+    const int16_t* in   = &s->periodbuf[dec->channel];
+    unsigned int   peak = dec->meter_peak;
+    int64_t        sum  = dec->meter_sum;
+
+    for (unsigned int i = 0; i < periodsize; ++i)
+    {
+      int x = in[n_channels * i];
+
+      dec->meter_clipped += (x <= -32768 || x >= 32767);
+      peak = MAX(peak, (unsigned int)abs(x));
+      sum += x;
+    }
+    dec->meter_peak   = peak;
+    dec->meter_sum    = sum;
+    dec->meter_count += periodsize;
+  }
+
+  double now = monotonic_time();
+
+  if (now - meter_time < 0.25)
+    return;
+
+  meter_time = now;
+  fputs("\r\033[4C", stderr);
+
+  for (unsigned int d = 0; d < n_decoders; ++d)
+  {
+    Decoder*     dec = &s->decoders[d];
+    char         hist[METER_BINS + 1];
+    unsigned int max = 1;
+
+    for (int i = 0; i < METER_BINS; ++i)
+      max = MAX(max, dec->meter_margins[i]);
+
+    for (int i = 0; i < METER_BINS; ++i)
+      hist[i] = levels[(dec->meter_margins[i] * (sizeof levels - 2) + max - 1) / max];
+    hist[METER_BINS] = '\0';
+
+    fprintf(stderr, "%sch%u %5.1f dBFS clip %-4u dc %+5.1f%% ",
+            (d > 0) ? " | " : "", dec->channel + 1,
+            20.0 * log10(MAX(1u, dec->meter_peak) / 32768.0), dec->meter_clipped,
+            100.0 * dec->meter_sum / (MAX(1u, dec->meter_count) * 32768.0));
+
+    if (dec->locked)
+      fprintf(stderr, "LOCK %ux %5.1f us [%s]", dec->tapespeed,
+              5e5 * dec->sync_period / samplerate, hist);
+    else
+      fprintf(stderr, "%-17s[%s]", "----", hist);
+
+    dec->meter_peak    = 0;
+    dec->meter_clipped = 0;
+    dec->meter_count   = 0;
+    dec->meter_sum     = 0;
+    memset(dec->meter_margins, 0, sizeof dec->meter_margins);
+  }
+  fputs("\033[K\r", stderr);
+}
+
+/* Read the next period of input and pass it on to each decoder.
+ */
+static void
+scan_period(Stream* s)
+{
+  if (infile_trace)
+  {
+    if (!read_trace_period(s))
+    {
+      pad_input(s);
+      return;
+    }
+  }
+  else
+  {
+    if (!read_period(s))
+    {
+      pad_input(s);
+      return;
+    }
+    keep_history(s);
+
+    // When decoding from a file, skip over gaps without running the edge
+    // detector.  The decoders see the skipped time as absence of edges.
+    if (s->file && gap_level > 0 && period_is_silent(s))
+    {
+      do
+      {
+        s->scantime += 2 * periodsize;
+
+        if (!read_period(s))
+        {
+          pad_input(s);
+          return;
+        }
+        keep_history(s);
+      }
+      while (period_is_silent(s));
+
+      // Start over behind the gap, so that no crossing from before the gap
+      // is reported, and no partial decimation group carried across it.
+      for (unsigned int i = 0; i < n_decoders; ++i)
+      {
+        Decoder* dec = &s->decoders[i];
+
+        dec->decim_phase   = 0;
+        dec->decim_acc     = 0;
+        dec->last_sample   = 0;
+        dec->schmitt_state = 0;
+        dec->last_crossing = s->scantime;
+      }
+    }
+    if (meter && s == &stream)
+      update_meter(s);
+
+    uint64_t time = s->scantime;
+
+    for (unsigned int i = 0; i < n_decoders; ++i)
+    {
+      Decoder*     dec   = &s->decoders[i];
+      unsigned int count = decimate(dec, s->periodbuf, periodsize, s->workbuf);
+
+      time = scan_channel(dec, s->workbuf, count, s->scantime);
+    }
+    s->scantime = time;
+  }
+  if (tracefile)
+  {
+    put_varint(0);
+    put_varint(s->scantime - tracemark);
+    tracemark = s->scantime;
+  }
+}
+
+static unsigned int
+wait_for_edge(Decoder* dec)
+{
+  unsigned int countdown = samplerate / (128 * MAX(1u, dec->tapespeed)) + 1;
+  uint64_t     limit     = (dec->edgetime >> 1) + countdown;
+
+  for (;;)
+  {
+    if (dec->edgepos < dec->edgecount)
+    {
+      // With hysteresis, the edge is reported late at the zero crossing
+      // before, which may precede the end of an expired countdown.
+      uint64_t time = MAX(dec->edges[dec->edgepos], dec->edgetime);
+
+      if ((time >> 1) > limit)
+        break;
+
+      unsigned int delta = time - dec->edgetime;
+
+      ++dec->edgepos;
+      dec->edgetime = time;
+      dec->lasthalf = delta;
+      return delta;
+    }
+    if ((dec->stream->scantime >> 1) > limit)
+      break;
+
+    scan_period(dec->stream);
+  }
+  dec->edgetime += 2 * countdown;
+  dec->lasthalf  = 2 * countdown;
+  return 2 * countdown; // countdown expired
+}
+
+/* Determine the playback speed factor from the lead-in half period, as the
+ * power of two closest to the ratio of nominal to measured frequency.
+ */
+static unsigned int
+detect_speed(unsigned int average)
+{
+  double       ratio  = samplerate / (1200.0 * average);
+  unsigned int factor = 1;
+
+  while (factor < MAX_SPEED && ratio > factor * M_SQRT2)
+    factor *= 2;
+
+  return factor;
+}
+
+static unsigned int
+sync_block(Decoder* dec)
+{
+  // Until the playback speed is known, let the band-pass filter admit
+  // lead-in tones up to the highest supported speed.
+  unsigned long lowspeed   = MAX(1u, dec->tapespeed);
+  unsigned long highspeed  = (dec->tapespeed > 0) ? dec->tapespeed : MAX_SPEED;
+  unsigned long min_period = samplerate / (8192 * highspeed);
+  unsigned long max_period = samplerate / (256 * lowspeed);
+
+  unsigned long timer = 4ul * samplerate; // about 2 seconds
+  unsigned long sum;
+  unsigned long count;
+  unsigned long period;
+
+  for (count = 0, sum = 0;; ++count, sum += period)
+  {
+    period = wait_for_edge(dec);
+
+    // Virtual band-pass filter
+    if (period > min_period && period < max_period)
+    {
+      unsigned long ex = count * period; // extrapolation
+
+      // Period within +/-25% of the average?
+      if (4 * ex >= 3 * sum && 4 * ex <= 5 * sum)
+        continue;
+
+      // Minimum duration passed and period within +/-33% of 2 * average?
+      if (count > LEADIN_THRESHOLD && 3 * ex > 4 * sum && 3 * ex < 8 * sum)
+      {
+        period = wait_for_edge(dec);
+        unsigned long average = (sum + count / 2) / count;
+
+        // Second half period within +/-25% of 2 * average?
+        if (2 * period > 3 * average && 2 * period < 5 * average)
+        {
+          if (speed_factor == 0)
+            dec->tapespeed = detect_speed(average);
+
+          return average;
+        }
+      }
+    }
+    if (timer <= sum)
+    {
+      dec->tapespeed = speed_factor; // look for a new tape speed after a gap
+      return 0;
+    }
+
+    timer -= sum;
+    sum   = 0;
+    count = 0;
+  }
+}
+
+/* Account for a successfully classified bit in the block statistics.  The
+ * decision thresholds are passed in twelfths of the sync period, as used by
+ * record_bit().  An upper threshold of zero means the range is open-ended.
+ */
+static int
+tally_bit(Decoder* dec, int bit, unsigned int first, unsigned int second,
+          unsigned int flo, unsigned int fhi, unsigned int slo, unsigned int shi)
+{
+  DecodeStats* st   = &dec->stats;
+  unsigned int norm = dec->sync_period;
+
+  unsigned int margin = MIN(12 * first - flo * norm, fhi * norm - 12 * first);
+  margin = MIN(margin, 12 * second - slo * norm);
+
+  if (shi != 0)
+    margin = MIN(margin, shi * norm - 12 * second);
+
+  if (margin < st->min_margin)
+    st->min_margin = margin;
+
+  // Bins of 1/32 of the sync period, i.e. 8 / (3 * norm) in twelfths.
+  ++dec->meter_margins[MIN(8 * margin / (3 * norm), METER_BINS - 1u)];
+
+  ++st->nbits;
+  ++st->histogram[MIN(first + second, histsize - 1)];
+
+  int dev = 2 * (int)first - (int)(norm << bit);
+  st->jitter_sum += (int64_t)dev * dev;
+  ++st->jitter_count;
+
+  // Skip the overlong second half period at the end of a block.
+  if (shi != 0 || second < 3 * norm)
+  {
+    dev = 2 * (int)second - (int)(norm << bit);
+    st->jitter_sum += (int64_t)dev * dev;
+    ++st->jitter_count;
+  }
+  dec->bitperiod = first + second;
+
+  return bit;
+}
+
+static int
+record_bit(Decoder* dec)
+{
+  unsigned int norm  = dec->sync_period;
+  unsigned int first = wait_for_edge(dec);
+
+  if (3 * first > norm && 3 * first < 8 * norm)
+  {
+    unsigned int second = wait_for_edge(dec);
+
+    // The last oscillation at the end of every block is missing its second
+    // half period: KC bug!  Thus, let overlong periods pass.
+    if (3 * second > norm)
+    {
+      if (4 * second < 3 * norm) // below norm/2 +50%?
+      {
+        if (first < norm)
+          return tally_bit(dec, BIT_0, first, second, 4, 12, 4, 9);
+      }
+      else if (3 * second > 4 * norm) // above 2*norm - 33%?
+      {
+        if (first > norm)
+          return tally_bit(dec, BIT_T, first, second, 12, 32, 16, 0);
+      }
+      else
+      {
+        if (3 * first > 2 * norm && 3 * first < 5 * norm) // within norm -33%/+66%?
+          return tally_bit(dec, BIT_1, first, second, 8, 20, 9, 16);
+      }
+    }
+  }
+  return BLOCK_DECODE;
+}
+
+/* Derive a soft decision from the period of the last data bit: the distance
+ * from the decision boundary at 1.5 times the nominal 0 bit period, scaled so
+ * that an ideal 0 bit maps to -64 and an ideal 1 bit to +64.
+ */
+static int
+soft_decision(const Decoder* dec)
+{
+  int norm = dec->sync_period;
+  int soft = 64 * (2 * (int)dec->bitperiod - 3 * norm) / norm;
+
+  return CLAMP(soft, -127, 127);
+}
+
+/* Re-establish the byte framing after a bit that could not be classified, by
+ * skipping ahead to the two long half periods of the next separator bit.  The
+ * search gives up after the given number of nominal 1 bit half periods.
+ */
+static int
+resync_byte(Decoder* dec, unsigned int nhalves)
+{
+  unsigned int  norm = dec->sync_period;
+  unsigned int  prev = dec->lasthalf;
+  unsigned long span = (unsigned long)nhalves * norm;
+
+  for (unsigned long elapsed = 0; elapsed < span;)
+  {
+    unsigned int half = wait_for_edge(dec);
+
+    // The second half period may be overlong at the end of the block.
+    if (3 * prev > 4 * norm && 3 * prev < 8 * norm && 3 * half > 4 * norm)
+      return BIT_T;
+
+    elapsed += half;
+    prev = half;
+  }
+  return BLOCK_SYNCLOSS;
+}
+
+/* With diversity reception, a damaged byte is not fatal as long as the byte
+ * framing can be recovered.  Its soft decisions are erased, so that the other
+ * channel's copy decides these bits alone.
+ */
+static int
+erase_byte(Decoder* dec, unsigned int start, int separator)
+{
+  if (separator < 0)
+    return separator;
+
+  memset(&dec->soft[start], 0, 8);
+  dec->nsoft = start + 8;
+  ++dec->erasures;
+
+  return 0;
+}
+
+static int
+record_byte(Decoder* dec)
+{
+  unsigned int start = dec->nsoft;
+  unsigned int byte  = 0;
+
+  for (int i = 0; i < 8; ++i)
+  {
+    int bit = record_bit(dec);
+
+    if (bit < 0 || bit > BIT_1)
+    {
+      if (!diversity)
+        return (bit < 0) ? bit : BLOCK_SYNC;
+
+      // A premature separator bit means that edges are missing.
+      return erase_byte(dec, start, (bit == BIT_T) ? BIT_T
+                                    : resync_byte(dec, 2 * (8 - i) + 6));
+    }
+    dec->soft[dec->nsoft++] = soft_decision(dec);
+
+    byte = (byte >> 1) | ((unsigned)bit << 7);
+  }
+
+  int bit = record_bit(dec);
+
+  if (bit != BIT_T)
+  {
+    if (!diversity)
+      return (bit < 0) ? bit : BLOCK_SYNCLOSS;
+
+    return erase_byte(dec, start, resync_byte(dec, 6));
+  }
+  return byte;
+}
+
+/* Decode one block into the decoder's data buffer.  Return the block number,
+ * or one of the negative BlockStatus codes on failure.
+ */
+static int
+record_block(Decoder* dec)
+{
+  DecodeStats* st = &dec->stats;
+  double synctime = monotonic_time();
+
+  st->nbits        = 0;
+  st->min_margin   = UINT_MAX;
+  st->jitter_sum   = 0;
+  st->jitter_count = 0;
+  memset(st->histogram, 0, histsize * sizeof st->histogram[0]);
+
+  dec->erasures    = 0;
+  dec->nsoft       = 0;
+  dec->pending     = 1;
+  dec->locked      = 0;
+
+  // Past the end of the input, there is no block to find among the edges
+  // that are left.
+  if (dec->stream->endpadding > 0 && dec->edgepos == dec->edgecount)
+  {
+    dec->edgetime    = MAX(dec->edgetime, dec->stream->scantime);
+    dec->sync_period = 0;
+  }
+  else
+    dec->sync_period = sync_block(dec);
+  dec->locked      = (dec->sync_period != 0);
+
+  double starttime = monotonic_time();
+
+  st->position    = dec->edgetime >> 1;
+  st->sync_period = dec->sync_period;
+  st->sync_time   = starttime - synctime;
+  st->decode_time = 0.0;
+
+  if (dec->sync_period == 0)
+    return (dec->result = BLOCK_TIMEOUT);
+
+  int blocknr = record_byte(dec);
+  unsigned int checksum = 0;
+
+  for (int i = 0; i < 128 && blocknr >= 0; ++i)
+  {
+    int byte = record_byte(dec);
+
+    if (byte < 0)
+      blocknr = byte;
+    else
+    {
+      dec->data[i] = byte;
+      checksum += byte;
+    }
+  }
+  if (blocknr >= 0)
+  {
+    int byte = record_byte(dec);
+
+    if (byte < 0)
+      blocknr = byte;
+    else if (dec->erasures > 0)
+      blocknr = BLOCK_DECODE;
+    else if ((checksum & 0xFF) != (unsigned)byte)
+      blocknr = BLOCK_CHECKSUM;
+  }
+  st->decode_time = monotonic_time() - starttime;
+  dec->locked     = 0;
+
+  return (dec->result = blocknr);
+}
+
+/* Combine the soft decisions of two failed copies of the same block.  Where
+ * only one copy got far enough to decode a bit, its decision is taken alone.
+ * Return the block number, or BLOCK_CHECKSUM if the combined block does not
+ * pass the checksum test either.
+ */
+static int
+combine_blocks(const Decoder* a, const Decoder* b, unsigned char* data)
+{
+  uint8_t bytes[BLOCK_BITS / 8] = { 0 };
+
+  // Without full coverage, report the error of the copy that got further.
+  if (MAX(a->nsoft, b->nsoft) < BLOCK_BITS)
+    return (a->nsoft >= b->nsoft) ? a->result : b->result;
+
+  for (unsigned int i = 0; i < BLOCK_BITS; ++i)
+  {
+    int sum = 0;
+
+    if (i < a->nsoft)
+      sum += a->soft[i];
+    if (i < b->nsoft)
+      sum += b->soft[i];
+
+    if (sum > 0)
+      bytes[i / 8] |= 1u << (i % 8);
+  }
+
+  unsigned int checksum = 0;
+
+  for (int i = 1; i <= 128; ++i)
+    checksum += bytes[i];
+
+  if ((checksum & 0xFF) != bytes[129])
+    return BLOCK_CHECKSUM;
+
+  memcpy(data, &bytes[1], 128);
+
+  return bytes[0];
+}
+
+static void
+print_json_histogram(const unsigned int* histogram)
+{
+  const char* sep = "";
+
+  fputs("\"histogram\":[", stdout);
+
+  for (unsigned int i = 0; i < histsize; ++i)
+    if (histogram[i] != 0)
+    {
+      printf("%s[%.2f,%u]", sep, 5e5 * i / samplerate, histogram[i]);
+      sep = ",";
+    }
+  putchar(']');
+}
+
+/* Return the smallest decision margin of a block, relative to the lead-in
+ * period.
+ */
+static double
+decision_margin(const DecodeStats* st)
+{
+  return (st->nbits > 0) ? st->min_margin / (12.0 * st->sync_period) : 0.0;
+}
+
+/* Emit one line of JSON for the block just decoded, and accumulate the
+ * whole-run aggregates.  All periods are given in microseconds.
+ */
+static void
+report_block(const DecodeStats* st, unsigned int tapespeed, int status, unsigned int source)
+{
+  DecodeStats*       rs = &runstats;
+
+  ++n_status[(status < 0) ? -status : 0];
+
+  if (status == BLOCK_TIMEOUT)
+    return;
+
+  rs->sync_time   += st->sync_time;
+  rs->decode_time += st->decode_time;
+  rs->nbits        += st->nbits;
+  rs->jitter_sum   += st->jitter_sum;
+  rs->jitter_count += st->jitter_count;
+
+  double margin = decision_margin(st);
+  min_margin = MIN(min_margin, margin);
+
+  for (unsigned int i = 0; i < histsize; ++i)
+    rs->histogram[i] += st->histogram[i];
+
+  min_sync_period  = MIN(min_sync_period, st->sync_period);
+  max_sync_period  = MAX(max_sync_period, st->sync_period);
+  sum_sync_period += st->sync_period;
+
+  if (!stats_json)
+    return;
+
+  printf("{\"type\":\"block\",\"block\":%d,\"status\":\"%s\",\"channel\":%u,"
+         "\"position\":%llu,\"time\":%.3f,\"sync_period\":%.2f,\"speed\":%.4f,"
+         "\"speed_factor\":%u,",
+         (status < 0) ? -1 : status, block_status_names[(status < 0) ? -status : 0],
+         source, (unsigned long long)st->position, (double)st->position / samplerate,
+         5e5 * st->sync_period / samplerate, samplerate / (1200.0 * st->sync_period),
+         tapespeed);
+
+  printf("\"bits\":%u,\"jitter\":%.2f,\"min_margin\":%.4f,"
+         "\"sync_time\":%.6f,\"decode_time\":%.6f,",
+         st->nbits,
+         (st->jitter_count > 0) ? 2.5e5 * sqrt((double)st->jitter_sum / st->jitter_count)
+                                  / samplerate : 0.0,
+         margin, st->sync_time, st->decode_time);
+
+  print_json_histogram(st->histogram);
+  fputs("}\n", stdout);
+  fflush(stdout);
+}
+
+static void
+report_summary(void)
+{
+  const DecodeStats* rs = &runstats;
+  unsigned int nblocks = 0;
+
+  for (int i = 0; i <= -BLOCK_CHECKSUM; ++i)
+    if (i != -BLOCK_TIMEOUT)
+      nblocks += n_status[i];
+
+  printf("{\"type\":\"summary\",\"complete\":%s,\"samplerate\":%u,"
+         "\"blocks\":%u,\"timeouts\":%u,\"errors\":{",
+         (run_complete) ? "true" : "false", samplerate, nblocks, n_status[-BLOCK_TIMEOUT]);
+
+  for (int i = -BLOCK_DECODE; i <= -BLOCK_CHECKSUM; ++i)
+    printf("%s\"%s\":%u", (i > -BLOCK_DECODE) ? "," : "",
+           block_status_names[i], n_status[i]);
+
+  printf("},\"ok\":%u,", n_status[0]);
+
+  if (nblocks > 0)
+  {
+    double mean = (double)sum_sync_period / nblocks;
+
+    printf("\"sync_period\":{\"min\":%.2f,\"max\":%.2f,\"mean\":%.2f},"
+           "\"speed\":{\"min\":%.4f,\"max\":%.4f,\"mean\":%.4f},",
+           5e5 * min_sync_period / samplerate, 5e5 * max_sync_period / samplerate,
+           5e5 * mean / samplerate,
+           samplerate / (1200.0 * max_sync_period), samplerate / (1200.0 * min_sync_period),
+           samplerate / (1200.0 * mean));
+  }
+  printf("\"bits\":%u,\"jitter\":%.2f,\"min_margin\":%.4f,"
+         "\"sync_time\":%.6f,\"decode_time\":%.6f,",
+         rs->nbits,
+         (rs->jitter_count > 0) ? 2.5e5 * sqrt((double)rs->jitter_sum / rs->jitter_count)
+                                  / samplerate : 0.0,
+         (nblocks > 0) ? min_margin : 0.0, rs->sync_time, rs->decode_time);
+
+  print_json_histogram(rs->histogram);
+  fputs("}\n", stdout);
+  fflush(stdout);
+}
+
+static void
+put_le(FILE* file, uint32_t value, int n)
+{
+  for (int i = 0; i < n; ++i)
+    putc((value >> (8 * i)) & 0xFF, file);
+}
+
+/* Create a new salvage dump named after the input file and the position of
+ * the block.  A numeric suffix is appended if the name is already taken, as
+ * for inputs of the same name in different directories.  Store the path in
+ * pathbuf.  Return 0 on failure, after reporting why.
+ */
+static FILE*
+create_salvage_file(uint64_t position, char* pathbuf, size_t bufsize)
+{
+  const char* name = (infilename && infile != stdin) ? infilename : "capture";
+  const char* base = strrchr(name, '/');
+
+  if (base)
+    name = base + 1;
+
+  const char* dot = strrchr(name, '.');
+  int         len = (dot && dot > name) ? (int)(dot - name) : (int)strlen(name);
+
+  for (unsigned int n = 0;; ++n)
+  {
+    if (n == 0)
+      snprintf(pathbuf, bufsize, "%s/%.*s-%llu.wav", salvage_dir, len, name,
+               (unsigned long long)position);
+    else
+      snprintf(pathbuf, bufsize, "%s/%.*s-%llu~%u.wav", salvage_dir, len, name,
+               (unsigned long long)position, n);
+
+    int fd = open(pathbuf, O_WRONLY | O_CREAT | O_EXCL, 0666);
+
+    if (fd >= 0)
+    {
+      FILE* file = fdopen(fd, "wb");
+
+      if (file)
+        return file;
+
+      close(fd);
+      unlink(pathbuf);
+      break;
+    }
+    if (errno != EEXIST)
+      break;
+  }
+  fprintf(stderr, "%s: %s, no salvage dump written\n", pathbuf, strerror(errno));
+  return 0;
+}
+
+/* Write the samples of a failed block from the history to a WAV file in the
+ * salvage directory, from a little before the end of the lead-in up to the
+ * longest the block could possibly be.  The input is scanned ahead as far as
+ * needed.  The file can be decoded again with -i, for instance with other
+ * decoder settings.  A comment in the INFO chunk records what went wrong,
+ * and the sync period and tape speed found.  Failure to write the dump is
+ * reported, but does not end decoding.
+ */
+static void
+salvage_block(Stream* s, const Decoder* dec, int status)
+{
+  const DecodeStats* st = &dec->stats;
+
+  // Blocks past the end of a segment are dumped by the next one.
+  if (!s->history || s->n_history == 0 || 2 * st->position >= s->endtime)
+    return;
+
+  // A block has 130 bytes of at most 8 bits of 1 and a separator bit, each
+  // taking two and four sync periods.  Add 50 ms of slack.
+  uint64_t start = 2 * st->position - MIN(2 * st->position, 2 * samplerate / 5);
+  uint64_t end   = 2 * st->position + 130 * 20 * (uint64_t)st->sync_period + samplerate / 10;
+
+  while (s->scantime < end && s->endpadding == 0)
+    scan_period(s);
+
+  end = MIN(end, s->scantime);
+  uint64_t first = (s->n_history > s->historysize) ? s->n_history - s->historysize : 0;
+  uint64_t frames = 0;
+
+  for (uint64_t i = first; i < s->n_history; ++i)
+  {
+    uint64_t t = s->historytime[i % s->historysize];
+
+    if (t + 2 * periodsize > start && t < end)
+      frames += (MIN(end, t + 2 * periodsize) - MAX(start, t)) / 2;
+  }
+  if (frames == 0)
+    return;
+
+  char comment[160];
+  char path[PATH_MAX];
+
+  int clen = snprintf(comment, sizeof comment,
+                      "kcrec salvage: %s at frame %llu, sync period %.2f us, speed factor %u",
+                      block_status_names[-status], (unsigned long long)st->position,
+                      5e5 * st->sync_period / samplerate, dec->tapespeed) + 1;
+  clen = MIN(clen, (int)sizeof comment);
+
+  uint32_t datasize = frames * n_channels * sizeof(int16_t);
+  uint32_t infosize = 4 + 8 + clen + (clen & 1);
+  FILE*    file     = create_salvage_file(st->position, path, sizeof path);
+
+  if (!file)
+    return;
+
+  fputs("RIFF", file);
+  put_le(file, 4 + 8 + 16 + 8 + infosize + 8 + datasize, 4);
+  fputs("WAVEfmt ", file);
+  put_le(file, 16, 4);
+  put_le(file, 1, 2);
+  put_le(file, n_channels, 2);
+  put_le(file, samplerate, 4);
+  put_le(file, samplerate * n_channels * sizeof(int16_t), 4);
+  put_le(file, n_channels * sizeof(int16_t), 2);
+  put_le(file, 16, 2);
+  fputs("LIST", file);
+  put_le(file, infosize, 4);
+  fputs("INFOICMT", file);
+  put_le(file, clen, 4);
+  fwrite(comment, clen, 1, file);
+  if (clen & 1)
+    putc(0, file);
+  fputs("data", file);
+  put_le(file, datasize, 4);
+
+  for (uint64_t i = first; i < s->n_history; ++i)
+  {
+    uint64_t t = s->historytime[i % s->historysize];
+
+    if (t + 2 * periodsize <= start || t >= end)
+      continue;
+
+    const int16_t* samples = &s->history[(i % s->historysize) * periodsize * n_channels];
+    uint64_t       from    = (MAX(start, t) - t) / 2;
+    uint64_t       to      = (MIN(end, t + 2 * periodsize) - t) / 2;
+
+    for (uint64_t k = from * n_channels; k < to * n_channels; ++k)
+      put_le(file, (uint16_t)samples[k], 2);
+  }
+  if (fclose(file) != 0)
+  {
+    fprintf(stderr, "%s: %s, no salvage dump written\n", path, strerror(errno));
+    unlink(path);
+    return;
+  }
+  fprintf(stderr, "%s: %s, salvage dump written\n", path, block_status_messages[-status]);
+}
+
+/* Receive the next block.  With diversity reception, blocks decoded from both
+ * channels at about the same tape position are copies of the same block: take
+ * the first copy that passes the checksum test, or else try to combine both.
+ * Blocks that cannot be paired are passed on in tape order, keeping the later
+ * one pending for the next round.  Set *from to the decoder whose statistics
+ * describe the block, and *source to its channel number counting from 1, or
+ * to 0 for a combined block.
+ */
+int
+receive_block(Stream* s, unsigned char* data, const Decoder** from, unsigned int* source)
+{
+  Decoder* a = &s->decoders[0];
+  Decoder* b = &s->decoders[n_decoders - 1];
+
+  if (!a->pending)
+    record_block(a);
+  if (!b->pending)
+    record_block(b);
+
+  const Decoder* dec = a;
+  int            status;
+
+  a->pending = 0;
+  b->pending = 0;
+
+  if (a != b && b->result != BLOCK_TIMEOUT)
+  {
+    uint64_t tolerance = samplerate / 64;
+
+    if (a->result == BLOCK_TIMEOUT
+        || a->stats.position > b->stats.position + tolerance)
+    {
+      a->pending = (a->result != BLOCK_TIMEOUT);
+      dec = b;
+    }
+    else if (b->stats.position > a->stats.position + tolerance)
+      b->pending = 1;
+    else if (a->result < 0)
+    {
+      if (b->result >= 0)
+        dec = b;
+      else if ((status = combine_blocks(a, b, data)) >= 0)
+      {
+        *from   = a;
+        *source = 0;
+        return status;
+      }
+    }
+  }
+  status = dec->result;
+
+  if (status >= 0)
+    memcpy(data, dec->data, sizeof dec->data);
+  else if (status < BLOCK_TIMEOUT && salvage_dir)
+    salvage_block(s, dec, status);
+
+  *from   = dec;
+  *source = dec->channel + 1;
+
+  return status;
+}
+
+/* Derive the decoding parameters from the format of the input.
+ */
+void
+init_decoding(void)
+{
+  // Decode at the working rate, but keep the time base of the capture rate.
+  // The working rate is raised if need be to limit the decimation ratio.
+  decimation = CLAMP(samplerate / workrate, 1u, MAX_DECIMATION);
+  histsize   = samplerate / 128 + 1;
+}
+
+void
+init_stream(Stream* s, FILE* file, uint64_t start)
+{
+  memset(s, 0, sizeof *s);
+
+  s->file      = file;
+  s->periodbuf = calloc(periodsize * n_channels, sizeof(int16_t));
+  s->workbuf   = calloc(periodsize, sizeof(int32_t));
+  s->scantime  = 2 * start;
+  s->endtime   = UINT64_MAX;
+  s->filerest  = (start < infile_frames) ? infile_frames - start : 0;
+
+  if (salvage_dir && !infile_trace)
+  {
+    s->historysize = HISTORY_SECONDS * samplerate / periodsize + 1;
+    s->history     = calloc((size_t)s->historysize * periodsize * n_channels, sizeof(int16_t));
+    s->historytime = calloc(s->historysize, sizeof(uint64_t));
+
+    if (!s->history || !s->historytime)
+      kc_exit_error("sample history");
+  }
+
+  for (unsigned int i = 0; i < n_decoders; ++i)
+  {
+    Decoder* dec = &s->decoders[i];
+
+    dec->stream    = s;
+    dec->channel   = (diversity) ? i : channel;
+    dec->tapespeed = speed_factor;
+    dec->edgetime  = s->scantime;
+    dec->tracetime = s->scantime;
+    dec->stats.histogram = calloc(histsize, sizeof(unsigned int));
+  }
+}
+
+void
+free_stream(Stream* s)
+{
+  for (unsigned int i = 0; i < n_decoders; ++i)
+  {
+    free(s->decoders[i].stats.histogram);
+    free(s->decoders[i].edges);
+  }
+  free(s->historytime);
+  free(s->history);
+  free(s->workbuf);
+  free(s->periodbuf);
+}
+
+/* Open the input file once more, positioned at the given frame.
+ */
+static FILE*
+open_segment(uint64_t start)
+{
+  FILE* file = fopen(infilename, "rb");
+
+  if (!file || fseeko(file, infile_data + (off_t)(start * n_channels * sizeof(int16_t)),
+                      SEEK_SET) < 0)
+    kc_exit_error(infilename);
+
+  return file;
+}
+
+/* Search for the start of a lead-in tone, up to the time limit in half
+ * frames.  Return the time stamp of its first edge, or 0 if none was found.
+ */
+static uint64_t
+find_leadin(Decoder* dec, uint64_t limit)
+{
+  unsigned long highspeed  = (speed_factor > 0) ? speed_factor : MAX_SPEED;
+  unsigned long min_period = samplerate / (8192 * highspeed);
+  unsigned long max_period = samplerate / (256 * MAX(1u, speed_factor));
+  unsigned long sum        = 0;
+  unsigned long count      = 0;
+  uint64_t      start      = 0;
+
+  while (dec->edgetime < limit)
+  {
+    unsigned long period = wait_for_edge(dec);
+
+    if (period > min_period && period < max_period)
+    {
+      unsigned long ex = count * period; // extrapolation
+
+      // Period within +/-25% of the average?  Otherwise, start over.
+      if (count == 0 || 4 * ex < 3 * sum || 4 * ex > 5 * sum)
+      {
+        start = dec->edgetime - period;
+        sum   = 0;
+        count = 0;
+      }
+      sum += period;
+
+      if (++count >= LEADIN_THRESHOLD)
+        return start;
+    }
+    else
+      count = 0;
+  }
+  return 0;
+}
+
+static void
+get_input_format(InputFormat* format)
+{
+  format->name       = infilename;
+  format->data       = infile_data;
+  format->frames     = infile_frames;
+  format->periodsize = periodsize;
+  format->samplerate = samplerate;
+  format->n_channels = n_channels;
+  format->decimation = decimation;
+  format->histsize   = histsize;
+}
+
+static void
+set_input_format(const InputFormat* format)
+{
+  infilename    = format->name;
+  infile_data   = format->data;
+  infile_frames = format->frames;
+  periodsize    = format->periodsize;
+  samplerate    = format->samplerate;
+  n_channels    = format->n_channels;
+  decimation    = format->decimation;
+  histsize      = format->histsize;
+}
+
+static void*
+decode_segment(void* arg)
+{
+  Segment* seg = arg;
+
+  set_input_format(&seg->format);
+
+  for (;;)
+  {
+    BlockResult    result;
+    const Decoder* dec;
+
+    result.status = receive_block(&seg->stream, result.data, &dec, &result.source);
+
+    // Blocks past the end belong to the next segment.  The last segment
+    // ends with the timeout after the end of the input.
+    if (2 * dec->stats.position >= seg->stream.endtime)
+      break;
+
+    if (seg->n_results == seg->size)
+    {
+      seg->size    = MAX(16u, 2 * seg->size);
+      seg->results = realloc(seg->results, seg->size * sizeof seg->results[0]);
+
+      if (!seg->results)
+        kc_exit_error("decoding results");
+    }
+    result.tapespeed = dec->tapespeed;
+    result.stats     = dec->stats;
+    result.stats.histogram = malloc(histsize * sizeof(unsigned int));
+    memcpy(result.stats.histogram, dec->stats.histogram, histsize * sizeof(unsigned int));
+
+    seg->results[seg->n_results++] = result;
+  }
+  return 0;
+}
+
+/* Decode the input file in parallel.  A pre-scan moves each of the evenly
+ * spaced split points forward to the start of the next lead-in tone, where
+ * no block can be cut in two.  Each segment is then decoded by a worker
+ * thread with decoders of its own, and the results are merged in order for
+ * next_block() to pass on.
+ */
+static void
+decode_parallel(void)
+{
+  off_t length;
+
+  if (fseeko(infile, 0, SEEK_END) < 0 || (length = ftello(infile)) < 0)
+    kc_exit_error(infilename);
+
+  infile_frames = MIN(infile_frames, (uint64_t)(length - infile_data)
+                                     / (n_channels * sizeof(int16_t)));
+
+  Segment*     segments = calloc(n_jobs, sizeof segments[0]);
+  uint64_t     total    = 2 * infile_frames;
+  uint64_t     start    = 0;
+  unsigned int n        = 0;
+
+  for (unsigned int k = 1; k <= n_jobs; ++k)
+  {
+    uint64_t end = total;
+
+    if (k < n_jobs)
+    {
+      Stream probe;
+      uint64_t split = total / n_jobs * k;
+
+      init_stream(&probe, open_segment(split / 2), split / 2);
+      end = find_leadin(&probe.decoders[0], total / n_jobs * (k + 1));
+      fclose(probe.file);
+      free_stream(&probe);
+
+      if (end <= start)
+        continue;
+    }
+    // Start a little early to catch the first edge of the lead-in.
+    uint64_t frame = (start > 0) ? start / 2 - MIN(start / 2, samplerate / 1000) : 0;
+
+    get_input_format(&segments[n].format);
+    init_stream(&segments[n].stream, open_segment(frame), frame);
+    segments[n].stream.endtime = end;
+    start = end;
+    ++n;
+  }
+
+  for (unsigned int i = 0; i < n; ++i)
+    if (pthread_create(&segments[i].thread, 0, &decode_segment, &segments[i]) != 0)
+    {
+      fputs("Failed to create decoding thread\n", stderr);
+      exit(1);
+    }
+
+  for (unsigned int i = 0; i < n; ++i)
+  {
+    Segment* seg = &segments[i];
+
+    pthread_join(seg->thread, 0);
+
+    results = realloc(results, (n_results + seg->n_results) * sizeof results[0]);
+
+    if (!results && n_results + seg->n_results > 0)
+      kc_exit_error("decoding results");
+
+    memcpy(&results[n_results], seg->results, seg->n_results * sizeof results[0]);
+    n_results += seg->n_results;
+
+    fclose(seg->stream.file);
+    free_stream(&seg->stream);
+    free(seg->results);
+  }
+  free(segments);
+  parallel = 1;
+}
+
+/* Account for a block of the file being recorded in batch mode.
+ */
+static void
+tally_health(const DecodeStats* st, int status, unsigned int source)
+{
+  if (status < 0)
+    health.status = status;
+  else
+  {
+    ++health.nblocks;
+    health.ncombined += (source == 0);
+    health.min_margin = MIN(health.min_margin, decision_margin(st));
+  }
+}
+
+/* Check whether the status returned by next_block() means that the input
+ * has run out.
+ */
+int
+end_of_input(int status)
+{
+  return (status == BLOCK_TIMEOUT && stream.endpadding > 0);
+}
+
+/* Decode the next block and report it.  Unless extracting all files, bail
+ * out on any error other than a timeout.
+ */
+int
+next_block(unsigned char* data)
+{
+  int status;
+
+  if (parallel)
+  {
+    // Pass on a timeout at the end of the results, like a decoder running
+    // out of input.
+    if (next_result == n_results)
+    {
+      stream.endpadding = periodsize;
+      ++n_status[-BLOCK_TIMEOUT];
+
+      return BLOCK_TIMEOUT;
+    }
+    BlockResult* result = &results[next_result++];
+
+    status = result->status;
+    memcpy(data, result->data, sizeof result->data);
+    report_block(&result->stats, result->tapespeed, status, result->source);
+    free(result->stats.histogram);
+  }
+  else
+  {
+    const Decoder* dec;
+    unsigned int   source;
+
+    status = receive_block(&stream, data, &dec, &source);
+
+    if (batchname)
+      tally_health(&dec->stats, status, source);
+    else
+      report_block(&dec->stats, dec->tapespeed, status, source);
+  }
+
+  if (status < BLOCK_TIMEOUT && !extract_all && !batchname)
+  {
+    fprintf(stderr, "%s\n", block_status_messages[-status]);
+    exit(1);
+  }
+  return status;
+}
+
+/* Validate the start block of a file in the given base format.  Return the
+ * number of blocks of the file, or 0 if the start block is invalid.  For the
+ * KC-BASIC formats, also store the program length.
+ */
+int
+parse_start_block(const uint8_t* block, KCFileFormat format, unsigned int* length)
+{
+  if (KC_BASE_FORMAT(format) == KC_FORMAT_SSS)
+  {
+    if (!kc_is_basic_signature(block))
+      return 0;
+
+    *length = block[11] | (unsigned)block[12] << 8;
+
+    return (14 + 127 + *length) / 128;
+  }
+  else // KC_BASE_FORMAT(format) == KC_FORMAT_KCC
+  {
+    unsigned int load  = block[17] | (unsigned)block[18] << 8;
+    unsigned int end   = block[19] | (unsigned)block[20] << 8;
+    int          nargs = block[16];
+
+    if (nargs < 2 || nargs > 10 || load >= end)
+      return 0;
+
+    return (128 + 127 + end - load) / 128;
+  }
+}
+
+void
+print_start_block(const uint8_t* block, KCFileFormat format)
+{
+  wchar_t name[12];
+
+  for (int i = 0; i < 11; ++i)
+    name[i] = kc_to_wide_char(block[i]);
+  name[11] = L'\0';
+
+  printf("%ls", name);
+
+  if (KC_BASE_FORMAT(format) == KC_FORMAT_KCC)
+  {
+    unsigned int load = block[17] | (unsigned)block[18] << 8;
+    unsigned int end  = block[19] | (unsigned)block[20] << 8;
+
+    printf(" %.4X %.4X", load, end);
+
+    if (block[16] >= 3)
+      printf(" %.4X", block[21] | (unsigned)block[22] << 8);
+  }
+  putchar('\n');
+}
+
+/* Return the block number expected at the given position of a file.
+ */
+int
+expected_blocknr(KCFileFormat format, int pos, int nblocks)
+{
+  return (KC_BASE_FORMAT(format) == KC_FORMAT_SSS || pos < nblocks) ? pos & 0xFF : 0xFF;
+}
+
+/* Write the block at the given position of a file.  The KC-BASIC format
+ * starts with the program length, and its last block is cut short.  In the
+ * TAP format, each block but the first is preceded by its block number.
+ */
+void
+write_block(FILE* kcfile, const char* filename, KCFileFormat format,
+            int pos, int blocknr, int nblocks, unsigned int length, const uint8_t* block)
+{
+  size_t offset    = 0;
+  size_t writesize = 128;
+
+  if (KC_BASE_FORMAT(format) == KC_FORMAT_SSS)
+  {
+    if (pos == 1)
+    {
+      offset    = 11;
+      writesize = MIN(128 - 11, 3 + length);
+    }
+    else if (pos == nblocks)
+      writesize = 128 + 14 + length - nblocks * 128;
+  }
+  else if (KC_BASE_FORMAT(format) == KC_FORMAT_TAP && pos > 1)
+  {
+    if (putc(blocknr, kcfile) == EOF)
+      kc_exit_error(filename);
+  }
+  if (fwrite(&block[offset], writesize, 1, kcfile) == 0)
+    kc_exit_error(filename);
+}
+
+/* Write the start block, then receive and write the remaining blocks of the
+ * file.  Return 0 on success, or an error message.  On a block sequence
+ * error, the offending block is left in the buffer, and its number stored
+ * to *badnr unless badnr is null.
+ */
+const char*
+record_blocks(FILE* kcfile, const char* filename, KCFileFormat format,
+              int nblocks, unsigned int length, uint8_t* block, int* badnr)
+{
+  int blocknr = 1;
+
+  write_block(kcfile, filename, format, 1, blocknr, nblocks, length, block);
+
+  for (int i = 2; i <= nblocks; ++i)
+  {
+    blocknr = next_block(block);
+
+    if (blocknr < BLOCK_TIMEOUT)
+      return block_status_messages[-blocknr];
+
+    if (blocknr < 0)
+      break;
+
+    if (KC_BASE_FORMAT(format) != KC_FORMAT_TAP)
+    {
+      if (blocknr != expected_blocknr(format, i, nblocks))
+      {
+        if (stdout_isterm)
+          printf("\r%.2X*\n", blocknr);
+        if (badnr)
+          *badnr = blocknr;
+
+        return "Block sequence error";
+      }
+    }
+    if (stdout_isterm)
+    {
+      printf("\r%.2X>", blocknr);
+      fflush(stdout);
+    }
+
+    write_block(kcfile, filename, format, i, blocknr, nblocks, length, block);
+  }
+
+  if (stdout_isterm)
+    putchar('\n');
+
+  if (blocknr < 0 && KC_BASE_FORMAT(format) != KC_FORMAT_TAP)
+    return (end_of_input(blocknr)) ? "Unexpected end of input" : "Block sequence timeout";
+
+  return 0;
+}
+
+static void
+record_kcfile(const char* filename, KCFileFormat format)
+{
+  FILE*        kcfile;
+  unsigned int length  = 0;
+  int          blocknr;
+  int          nblocks = INT_MAX / 128;
+  uint8_t      block[128];
+
+  if (format == KC_FORMAT_ANY)
+  {
+    format = kc_format_from_filename(filename);
+
+    if (format == KC_FORMAT_ANY)
+      format = KC_FORMAT_TAP;
+  }
+
+  if (filename[0] == '-' && filename[1] == '\0')
+    kcfile = stdout;
+  else
+    if (!(kcfile = fopen(filename, "wb")))
+      kc_exit_error(filename);
+
+  if (KC_BASE_FORMAT(format) == KC_FORMAT_TAP)
+  {
+    // For TAP files, record blocks in whatever order they come in.
+    do
+    {
+      blocknr = next_block(block);
+
+      if (end_of_input(blocknr))
+        exit_input_error("Unexpected end of input");
+    }
+    while (blocknr < 0);
+
+    if (stdout_isterm)
+    {
+      printf("\r%.2X>", blocknr);
+      fflush(stdout);
+    }
+    if (fputs(KC_TAP_MAGIC, kcfile) < 0 || putc(blocknr, kcfile) == EOF)
+      kc_exit_error(filename);
+  }
+  else
+  {
+    while ((blocknr = next_block(block)) != 1)
+      if (end_of_input(blocknr))
+        exit_input_error("Unexpected end of input");
+      else if (blocknr >= 0 && stdout_isterm)
+      {
+        printf("%.2X*\n", blocknr);
+        fflush(stdout);
+      }
+
+    if (stdout_isterm)
+      print_start_block(block, format);
+
+    nblocks = parse_start_block(block, format, &length);
+
+    if (nblocks == 0)
+    {
+      fputs((KC_BASE_FORMAT(format) == KC_FORMAT_SSS) ? "Invalid KC-BASIC start block\n"
+                                                       : "Invalid KCC start block\n", stderr);
+      exit(1);
+    }
+  }
+
+  const char* error = record_blocks(kcfile, filename, format, nblocks, length, block, 0);
+
+  if (kcfile != stdout && fclose(kcfile) != 0)
+    kc_exit_error(filename);
+
+  if (error)
+  {
+    fprintf(stderr, "%s\n", error);
     exit(1);
   }
 }
 
+/* Convert the file name found on tape for use as a local file name.
+ * Characters that cannot be used in file names are replaced, and trailing
+ * blanks are removed.  Return the length of the name.
+ */
+size_t
+get_tape_name(const uint8_t* block, KCFileFormat format, char name[8 * MB_LEN_MAX + 1])
+{
+  size_t    len = 0;
+  mbstate_t state;
+
+  memset(&state, 0, sizeof state);
+
+  for (int i = 0; i < 8; ++i)
+  {
+    wchar_t wc = kc_to_wide_char(block[(KC_BASE_FORMAT(format) == KC_FORMAT_SSS) ? 3 + i : i]);
+
+    if (wc < 0x20 || wc == L'/' || (wc == L'.' && len == 0))
+      wc = L'_';
+
+    size_t nbytes = wcrtomb(&name[len], wc, &state);
+
+    if (nbytes == (size_t)-1)
+    {
+      memset(&state, 0, sizeof state);
+      name[len] = '_';
+      nbytes = 1;
+    }
+    len += nbytes;
+  }
+  while (len > 0 && name[len - 1] == ' ')
+    --len;
+
+  name[len] = '\0';
+
+  return len;
+}
+
+/* Get the file name extension for the start block.  The KC-BASIC variants
+ * are distinguished by the signature character.
+ */
+void
+get_tape_extension(const uint8_t* block, KCFileFormat format, char extension[4])
+{
+  memset(extension, 0, 4);
+
+  if (KC_BASE_FORMAT(format) == KC_FORMAT_SSS)
+    memset(extension, block[0] & 0x7F, 3);
+  else
+    memcpy(extension, kc_format_name(format), 3);
+}
+
+/* Format the path of an extracted file, named after the file name found on
+ * tape.  For n > 0, a numeric suffix is appended to make the name unique.
+ */
+static void
+format_extracted_path(const uint8_t* block, KCFileFormat format, unsigned int n,
+                      char* pathbuf, size_t bufsize)
+{
+  char        name[8 * MB_LEN_MAX + 1];
+  char        extension[4];
+  const char* base = (get_tape_name(block, format, name) > 0) ? name : "NONAME";
+
+  get_tape_extension(block, format, extension);
+
+  if (n == 0)
+    snprintf(pathbuf, bufsize, "%s/%s.%s", extract_dir, base, extension);
+  else
+    snprintf(pathbuf, bufsize, "%s/%s~%u.%s", extract_dir, base, n, extension);
+}
+
+/* Create a new output file in the extraction directory, named after the
+ * file name found on tape.  A numeric suffix is appended if the name is
+ * already taken.  Store the path in pathbuf.
+ */
+FILE*
+create_extracted_file(const uint8_t* block, KCFileFormat format,
+                      char* pathbuf, size_t bufsize)
+{
+  for (unsigned int n = 0;; ++n)
+  {
+    format_extracted_path(block, format, n, pathbuf, bufsize);
+
+    int fd = open(pathbuf, O_WRONLY | O_CREAT | O_EXCL, 0666);
+
+    if (fd >= 0)
+    {
+      FILE* file = fdopen(fd, "wb");
+
+      if (!file)
+        kc_exit_error(pathbuf);
+
+      return file;
+    }
+    if (errno != EEXIST)
+      kc_exit_error(pathbuf);
+  }
+}
+
+/* Create a hidden file in the spool directory, to be published under its
+ * proper name once complete.  Store the path in pathbuf.
+ */
+static FILE*
+create_spool_file(char* pathbuf, size_t bufsize)
+{
+  snprintf(pathbuf, bufsize, "%s/.kcrec-XXXXXX", extract_dir);
+
+  int    fd   = mkstemp(pathbuf);
+  mode_t mask = umask(0);
+
+  umask(mask);
+
+  // Give the file the permissions it would have been created with.
+  FILE* file = (fd >= 0 && fchmod(fd, 0666 & ~mask) == 0) ? fdopen(fd, "wb") : 0;
+
+  if (!file)
+    kc_exit_error(pathbuf);
+
+  return file;
+}
+
+/* Move a complete file from its hidden name in the spool directory to its
+ * name as found on tape, so that it appears all at once.  Store the new path
+ * in pathbuf.  On file systems without hard links, such as FAT, the file is
+ * renamed instead if the name is free.
+ */
+static void
+publish_spool_file(const char* tmppath, const uint8_t* block, KCFileFormat format,
+                   char* pathbuf, size_t bufsize)
+{
+  for (unsigned int n = 0;; ++n)
+  {
+    struct stat st;
+
+    format_extracted_path(block, format, n, pathbuf, bufsize);
+
+    if (link(tmppath, pathbuf) == 0)
+      break;
+
+    if (errno == EEXIST)
+      continue;
+
+    if (errno != EPERM && errno != EOPNOTSUPP && errno != ENOSYS)
+      kc_exit_error(pathbuf);
+
+    if (lstat(pathbuf, &st) == 0)
+      continue;
+
+    if (errno != ENOENT || rename(tmppath, pathbuf) < 0)
+      kc_exit_error(pathbuf);
+
+    return;
+  }
+  unlink(tmppath);
+}
+
+/* Decode the whole recording, and write every file found to the extraction
+ * directory.  Files are recognized by their start block, and written in the
+ * KCC or KC-BASIC format according to its contents.  Damaged files are
+ * reported and skipped.  A start block that breaks the block sequence of the
+ * file before begins the next file.  With file input, stop at the end of the
+ * input.  Return the number of files that could not be extracted.
+ */
+static int
+extract_kcfiles(void)
+{
+  uint8_t block[128];
+  char    path[PATH_MAX];
+  char    saved[PATH_MAX];
+  int     nfiles  = 0;
+  int     nfailed = 0;
+  int     badnr   = 0;
+
+  for (;;)
+  {
+    int blocknr = (badnr == 1) ? 1 : next_block(block);
+
+    badnr = 0;
+
+    if (end_of_input(blocknr))
+      break;
+
+    if (blocknr != 1)
+    {
+      if (blocknr >= 0 && stdout_isterm)
+      {
+        printf("%.2X*\n", blocknr);
+        fflush(stdout);
+      }
+      else if (blocknr < BLOCK_TIMEOUT)
+        fprintf(stderr, "%s\n", block_status_messages[-blocknr]);
+
+      continue;
+    }
+
+    KCFileFormat format  = (kc_is_basic_signature(block)) ? KC_FORMAT_SSS : KC_FORMAT_KCC;
+    unsigned int length  = 0;
+    int          nblocks = parse_start_block(block, format, &length);
+
+    if (nblocks == 0)
+    {
+      fputs("Invalid start block, file skipped\n", stderr);
+      ++nfailed;
+      continue;
+    }
+    if (stdout_isterm)
+      print_start_block(block, format);
+
+    // In daemon mode, files appear in the spool directory only once complete.
+    uint8_t     header[128];
+    FILE*       kcfile = (preroll > 0) ? create_spool_file(path, sizeof path)
+                                       : create_extracted_file(block, format, path, sizeof path);
+
+    memcpy(header, block, sizeof header);
+
+    const char* error = record_blocks(kcfile, path, format, nblocks, length, block, &badnr);
+
+    if (fclose(kcfile) != 0)
+      kc_exit_error(path);
+
+    if (error)
+    {
+      if (preroll > 0)
+        format_extracted_path(header, format, 0, saved, sizeof saved);
+
+      fprintf(stderr, "%s: %s, file discarded\n", (preroll > 0) ? saved : path, error);
+      unlink(path);
+      ++nfailed;
+    }
+    else
+    {
+      if (preroll > 0)
+      {
+        publish_spool_file(path, header, format, saved, sizeof saved);
+
+        if (!stdout_isterm)
+        {
+          printf("%s\n", saved);
+          fflush(stdout);
+        }
+      }
+      ++nfiles;
+    }
+  }
+
+  if (stdout_isterm)
+    printf("%d files extracted, %d failed\n", nfiles, nfailed);
+
+  return nfailed;
+}
+
 int
 main(int argc, char** argv)
 {
   const char*  devname = "default";
+  const char*  inname  = 0;
+  const char*  tracename = 0;
   int          verbose = 0;
+  int          pick_channel = 0;
+  int          edge_options = 0;
   KCFileFormat format  = KC_FORMAT_ANY;
+  int          status  = 0;
   int          c, rc;
 
-  while ((c = getopt(argc, argv, "c:d:r:t:v?")) != -1)
+  static const struct option longopts[] =
+  {
+    { "batch", required_argument, 0, 'B' },
+    { "daemon", required_argument, 0, 'D' },
+    { "merge", required_argument, 0, 'm' },
+    { "meter", no_argument, 0, 'M' },
+    { "salvage", required_argument, 0, 'S' },
+    { "stats", required_argument, 0, 's' },
+    { 0, 0, 0, 0 }
+  };
+
+  while ((c = getopt_long(argc, argv, "abB:c:d:D:e:g:H:i:j:m:Mr:S:t:vw:x:?", longopts, 0)) != -1)
     switch (c)
     {
-      case 'c': channel    = kc_parse_arg_int(optarg, 1, 256) - 1; break;
+      case 'a': extract_all = 1; break;
+      case 'b': diversity  = 1; break;
+      case 'B': batchname  = optarg; break;
+      case 'c': channel    = kc_parse_arg_int(optarg, 1, 256) - 1; pick_channel = 1; break;
       case 'd': devname    = optarg; break;
+      case 'D': preroll    = kc_parse_arg_int(optarg, 1, 3600); extract_all = 1; break;
+      case 'e': tracename  = optarg; break;
+      case 'g': gap_level  = kc_parse_arg_num(optarg, 0.0, 1.0, 32767.0); edge_options = 1; break;
+      case 'H': hysteresis = kc_parse_arg_num(optarg, 0.0, 1.0, 256.0); edge_options = 1; break;
+      case 'i': inname     = optarg; break;
+      case 'j': n_jobs     = kc_parse_arg_int(optarg, 1, 256); break;
+      case 'm': mergename  = optarg; break;
+      case 'M': meter      = 1; break;
       case 'r': samplerate = kc_parse_arg_num(optarg, 1.0, 1 << 24, 1.0); break;
+      case 's': stats_json = parse_arg_stats(optarg); break;
+      case 'S': salvage_dir = optarg; break;
       case 't': format     = kc_parse_arg_format(optarg); break;
       case 'v': verbose    = 1; break;
-      case '?': exit_usage();
+      case 'w': workrate   = kc_parse_arg_num(optarg, 1.0, 1 << 24, 1.0); edge_options = 1; break;
+      case 'x': speed_factor = parse_arg_speed(optarg); break;
+      case '?': exit_usage(optopt != 0);
       default:  abort();
     }
 
-  if (optind >= argc)
-    exit_usage();
+  if ((extract_all) ? optind + 1 < argc : optind >= argc)
+    exit_usage(1);
+
+  if (diversity && pick_channel)
+    exit_usage(1);
+
+  if (batchname && (extract_all || inname || tracename || stats_json || format != KC_FORMAT_ANY
+                    || mergename))
+    exit_usage(1);
+
+  if (mergename && (extract_all || inname || tracename || stats_json))
+    exit_usage(1);
+
+  if (preroll > 0 && (inname || n_jobs > 1))
+    exit_usage(1);
+
+  if (meter && (batchname || mergename || n_jobs > 1))
+    exit_usage(1);
+
+  if (meter && !isatty(STDERR_FILENO))
+  {
+    fputs("The signal meter requires a terminal\n", stderr);
+    exit(1);
+  }
+
+  if (extract_all && optind < argc)
+    extract_dir = argv[optind];
 
   setlocale(LC_ALL, "");
   stdout_isterm = isatty(STDOUT_FILENO);
 
+  if (stats_json)
+  {
+    // The statistics take over standard output, and JSON numbers must not
+    // be formatted according to the user's locale.
+    setlocale(LC_NUMERIC, "C");
+    stdout_isterm = 0;
+
+    for (int i = optind; i < argc && !extract_all; ++i)
+      if (argv[i][0] == '-' && argv[i][1] == '\0')
+      {
+        fputs("Cannot write statistics and file data to standard output\n", stderr);
+        exit(1);
+      }
+  }
+
+  if (diversity)
+  {
+    channel    = 1;
+    n_decoders = 2;
+  }
+  if (batchname)
+    return (run_batch(&argv[optind], argc - optind) > 0);
+
+  if (mergename)
+    return (run_merge(&argv[optind], argc - optind, format) > 0);
+
   n_channels = channel + 1;
-  init_audio(devname);
+
+  if (inname)
+  {
+    const char* error = open_input(inname);
+
+    if (error)
+      exit_input_error(error);
+  }
+  else
+    init_audio(devname);
+
+  // The edges of a trace were detected when it was recorded, and are
+  // replayed as they are.
+  if (edge_options && infile_trace)
+  {
+    fputs("Edge detection options do not apply to an edge trace\n", stderr);
+    exit(1);
+  }
+
+  if (salvage_dir && infile_trace)
+  {
+    fputs("Salvage dumps require sample data, not an edge trace\n", stderr);
+    exit(1);
+  }
+
+  if (n_jobs > 1 && (!infile || infile == stdin || infile_trace || tracename))
+  {
+    fputs("Parallel decoding requires a WAV input file, and no edge trace output\n", stderr);
+    exit(1);
+  }
 
   if (channel >= n_channels)
   {
-    fprintf(stderr, "Channel number %u out of range for stream with %u channels\n",
-            channel + 1, n_channels);
+    if (diversity)
+      fputs("Diversity reception requires a stereo stream\n", stderr);
+    else
+      fprintf(stderr, "Channel number %u out of range for stream with %u channels\n",
+              channel + 1, n_channels);
     exit(1);
   }
 
-  if (verbose && (rc = snd_pcm_dump(audio, output)) < 0)
+  if (verbose && audio && (rc = snd_pcm_dump(audio, output)) < 0)
     exit_snd_error(rc, "dump setup");
 
-  periodbuf = calloc(periodsize * n_channels, sizeof(int16_t));
-  periodpos = periodsize;
+  init_decoding();
+  runstats.histogram = calloc(histsize, sizeof(unsigned int));
 
-  for (int i = optind; i < argc; ++i)
-    record_kcfile(argv[i], format);
+  init_stream(&stream, infile, 0);
 
-  free(periodbuf);
+  if (preroll > 0)
+    start_capture(preroll);
 
-  if ((rc = snd_pcm_drop(audio)) < 0)
-    exit_snd_error(rc, "drop");
+  if (tracename)
+    open_trace(tracename);
 
-  if ((rc = snd_pcm_close(audio)) < 0)
-    exit_snd_error(rc, "close");
+  if (stats_json)
+    atexit(&report_summary);
 
-  return 0;
+  if (n_jobs > 1)
+    decode_parallel();
+
+  if (extract_all)
+    status = (extract_kcfiles() > 0);
+  else
+    for (int i = optind; i < argc; ++i)
+      record_kcfile(argv[i], format);
+
+  run_complete = 1;
+  free_stream(&stream);
+  free(results);
+
+  if (tracefile && fclose(tracefile) != 0)
+    kc_exit_error(tracefilename);
+
+  if (infile)
+    fclose(infile);
+  else
+  {
+    if ((rc = snd_pcm_drop(audio)) < 0)
+      exit_snd_error(rc, "drop");
+
+    if ((rc = snd_pcm_close(audio)) < 0)
+      exit_snd_error(rc, "close");
+  }
+  return status;
 }
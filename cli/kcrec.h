@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2008-2010  Daniel Elstner <daniel.kitta@gmail.com>
+ *
+ * KC-Rec is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KC-Rec is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef CLI_KCREC_H_INCLUDED
+#define CLI_KCREC_H_INCLUDED
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <libkc/libkc.h>
+
+/* Declarations shared by the decoder in kcrec.c and the batch and merge
+ * modes in recbatch.c.
+ */
+
+enum BlockStatus
+{
+  BLOCK_TIMEOUT  = -1,
+  BLOCK_DECODE   = -2,
+  BLOCK_SYNC     = -3,
+  BLOCK_SYNCLOSS = -4,
+  BLOCK_CHECKSUM = -5
+};
+
+enum { BLOCK_BITS = 130 * 8 }; // data bits of block number, data and checksum
+enum { METER_BINS = 8 };        // decision margin histogram bins of the signal meter
+
+/* An edge trace starts with the magic string, followed by the sample rate
+ * (32 bit) and the number of channels (8 bit), little-endian.  The rest is a
+ * sequence of unsigned LEB128 numbers.  The value 1 + channel + n_channels *
+ * delta records an edge, where delta is the time since the previous edge on
+ * the same channel.  The value 0 marks the end of a capture period and is
+ * followed by the length of the period.  All times are in half frames.
+ */
+#define TRACE_MAGIC "KCTRACE\1"
+enum { TRACE_MAGIC_LEN = 8, TRACE_HEADER_LEN = TRACE_MAGIC_LEN + 5 };
+
+typedef struct
+{
+  uint64_t      position;     // capture position after the lead-in in frames
+  double        sync_time;    // wall-clock time spent waiting for the lead-in
+  double        decode_time;  // wall-clock time spent decoding the block data
+  unsigned int  sync_period;  // average lead-in half period in half frames
+  unsigned int  nbits;        // number of bits decoded
+  unsigned int  min_margin;   // smallest decision margin in twelfths of half frames
+  uint64_t      jitter_sum;   // sum of squared half period deviations (quarter frames)
+  unsigned int  jitter_count; // number of half periods in jitter_sum
+  unsigned int* histogram;    // bit period histogram in half frames
+}
+DecodeStats;
+
+typedef struct Stream Stream;
+
+/* Decoder state of one audio channel.  With diversity reception, each channel
+ * of the stream is decoded independently, and the results are combined block
+ * by block.  Otherwise only the selected channel has a decoder.
+ */
+typedef struct
+{
+  Stream*       stream;
+  unsigned int  channel;
+  unsigned int  decim_phase;
+  int32_t       decim_acc;
+  int32_t       dc_offset;      // in 1/4096 sample units
+  unsigned int  peak_level;
+  int32_t       last_sample;
+  int32_t       schmitt_state;
+  uint64_t      last_crossing;
+  uint64_t*     edges;          // queue of edge time stamps in half frames
+  unsigned int  edgesize;
+  unsigned int  edgecount;
+  unsigned int  edgepos;
+  uint64_t      edgetime;       // time stamp of the last edge
+  uint64_t      tracetime;      // time stamp of the last edge traced
+  unsigned int  sync_period;
+  unsigned int  tapespeed;      // speed factor of the current tape
+  unsigned int  lasthalf;       // last half period taken
+  unsigned int  bitperiod;      // full period of the last bit decoded
+  int           result;         // block number or BlockStatus of the last block
+  int           pending;        // last block not yet passed on?
+  unsigned int  erasures;       // number of bytes erased
+  unsigned int  nsoft;
+  int8_t        soft[BLOCK_BITS]; // soft decisions of the data bits, 1 if positive
+  uint8_t       data[128];
+  DecodeStats   stats;
+  int           locked;           // lead-in found, decoding a block?
+  unsigned int  meter_peak;       // largest sample magnitude since the last meter update
+  unsigned int  meter_clipped;    // clipped samples since the last meter update
+  unsigned int  meter_count;      // samples since the last meter update
+  int64_t       meter_sum;        // sum of the samples since the last meter update
+  unsigned int  meter_margins[METER_BINS]; // decision margins since the last meter update
+}
+Decoder;
+
+/* Input state shared by the decoders of all channels.  The main thread reads
+ * from the capture device or the input file.  For parallel decoding, each
+ * worker thread reads a segment of the input file through a stream of its own.
+ */
+struct Stream
+{
+  FILE*         file;
+  int16_t*      periodbuf;
+  int32_t*      workbuf;
+  uint64_t      scantime;        // end of the scanned data in half frames
+  uint64_t      endtime;         // end of the stream's segment in half frames
+  uint64_t      infile_edges[2]; // time stamp of the last edge read from a trace
+  uint64_t      filerest;        // frames of WAV sample data left to read
+  unsigned int  endpadding;      // silence appended to the input in frames
+  int16_t*      history;         // recent periods kept for salvage dumps
+  uint64_t*     historytime;     // start time of each period kept in half frames
+  unsigned int  historysize;     // capacity of the history in periods
+  uint64_t      n_history;       // number of periods kept so far
+  Decoder       decoders[2];
+};
+
+/* Health of the blocks of a file recorded in batch mode.
+ */
+typedef struct
+{
+  unsigned int  nblocks;    // number of blocks received intact
+  unsigned int  ncombined;  // number of blocks combined from both channels
+  int           status;     // BlockStatus of the last failed block, if any
+  double        min_margin; // smallest decision margin of the blocks
+}
+BlockHealth;
+
+extern const char *const block_status_names[];
+
+extern unsigned int      n_jobs;
+extern unsigned int      channel;
+extern int               diversity;
+extern int               stdout_isterm;
+extern const char*       extract_dir;
+extern const char*       batchname;
+extern const char*       mergename;
+
+extern __thread Stream       stream;
+extern __thread FILE*        infile;
+extern __thread unsigned int n_channels;
+extern __thread BlockHealth  health;
+
+const char* open_input(const char* filename);
+void init_decoding(void);
+void init_stream(Stream* s, FILE* file, uint64_t start);
+void free_stream(Stream* s);
+int  receive_block(Stream* s, unsigned char* data, const Decoder** from, unsigned int* source);
+int  end_of_input(int status);
+int  next_block(unsigned char* data);
+
+int  parse_start_block(const uint8_t* block, KCFileFormat format, unsigned int* length);
+void print_start_block(const uint8_t* block, KCFileFormat format);
+int  expected_blocknr(KCFileFormat format, int pos, int nblocks);
+void write_block(FILE* kcfile, const char* filename, KCFileFormat format,
+                 int pos, int blocknr, int nblocks, unsigned int length, const uint8_t* block);
+const char* record_blocks(FILE* kcfile, const char* filename, KCFileFormat format,
+                          int nblocks, unsigned int length, uint8_t* block, int* badnr);
+
+size_t get_tape_name(const uint8_t* block, KCFileFormat format, char name[8 * MB_LEN_MAX + 1]);
+void   get_tape_extension(const uint8_t* block, KCFileFormat format, char extension[4]);
+FILE*  create_extracted_file(const uint8_t* block, KCFileFormat format,
+                             char* pathbuf, size_t bufsize);
+
+int run_batch(char** trees, int n_trees);
+int run_merge(char** inputs, int n_inputs, KCFileFormat format);
+
+#endif /* !CLI_KCREC_H_INCLUDED */
@@ -17,38 +17,171 @@
 
 #include <build/config.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <locale.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 #include <libkc/libkc.h>
 
 #define BAUDRATE_NORMAL B1200
-#define BAUDRATE_BOOST  B19200
+#define BOOST_WINDOW    8       /* blocks in flight before waiting for an ack */
+#define BOOST_RETRIES   5       /* retransmissions of a block before giving up */
+#define BOOST_BATCH     4       /* blocks per acknowledgement with CRC */
+#define REPLY_TIMEOUT   2000    /* milliseconds to wait for a reply byte */
+#define WRITE_TIMEOUT   10000   /* milliseconds to wait for the KC to take data */
+#define RTT_BINS        12      /* bins of the ack round trip histogram */
+#define PROBE_SETTLE    3000    /* milliseconds for the loader to fall back after a failed probe */
+#define BASIC_PROGRAM   0x0401  /* start of KC-BASIC program memory */
+#define BASIC_POINTERS  0x03D7  /* KC-BASIC pointers to the end of the program */
+
+typedef struct
+{
+  unsigned int  address;        /* target address of the block */
+  unsigned char size;           /* length of the frame */
+  unsigned char length;         /* length of the block data */
+  unsigned short checksum;      /* additive checksum or CRC of the batch */
+  unsigned char retries;
+  unsigned char ack;            /* does the block ask for an acknowledgement? */
+  unsigned char frame[5 + 128]; /* type, length, address, check byte and data */
+  double        sent;           /* time the frame was written */
+}
+BoostBlock;
+
+typedef struct
+{
+  unsigned int  baud;           /* nominal rate of the serial port */
+  speed_t       speed;
+  unsigned char timeconst;      /* CTC time constant of the V.24 module */
+}
+BoostRate;
+
+/* The boost rates to probe, fastest first.  The V.24 module runs at 55200
+ * Baud divided by the time constant, about 4% below the nominal rate of the
+ * serial port as with the default 19200 Baud.
+ */
+static const BoostRate boost_rates[] =
+{
+  { 57600, B57600, 1 },
+  { 19200, B19200, 3 },
+  { 9600,  B9600,  6 }
+};
 
+/* The hex dump consists of the 'T' command for the resident part of the
+ * loader, followed by address, length and code of the loader extension.
+ */
 static const unsigned char v24boostcode[] = /* hex dump of v24boost.asm */
 {
-  0x54, 0x00, 0xB7, 0x76, 0x00, 0x01, 0x03, 0x07,
-  0xCD, 0x47, 0xB7, 0xCD, 0x58, 0xB7, 0x5F, 0xCD,
-  0x58, 0xB7, 0x57, 0xCD, 0x58, 0xB7, 0x6F, 0xCD,
-  0x58, 0xB7, 0x67, 0x18, 0x13, 0xCD, 0x58, 0xB7,
-  0x12, 0x13, 0x80, 0x47, 0x0D, 0x20, 0xF6, 0xDB,
-  0x0B, 0xE6, 0x04, 0x28, 0xFA, 0x78, 0xD3, 0x09,
-  0x01, 0x80, 0x00, 0xAF, 0xED, 0x42, 0x30, 0xE5,
-  0x09, 0x4D, 0x6F, 0xB9, 0x38, 0xDF, 0x3E, 0x01,
-  0xF3, 0xD3, 0x0B, 0xDB, 0x0B, 0xFB, 0x0F, 0x30,
-  0xF5, 0x01, 0x2E, 0x09, 0x21, 0x6D, 0xB7, 0x3E,
-  0x47, 0xF3, 0xD3, 0x0D, 0x79, 0xD3, 0x0D, 0x0E,
-  0x0B, 0xED, 0xB3, 0xFB, 0xC9, 0xDB, 0x0B, 0x0F,
-  0x3F, 0x3E, 0x05, 0xF3, 0xD3, 0x0B, 0x3E, 0xD4,
-  0x1F, 0xD3, 0x0B, 0xFB, 0x07, 0x38, 0xEE, 0xDB,
-  0x09, 0xC9, 0x18, 0x04, 0x44, 0x03, 0xE1, 0x05,
-  0xEA, 0x11, 0x18
+  0x54, 0x00, 0xB7, 0x80, 0x00, 0x01, 0x03, 0x07,
+  0xCD, 0x51, 0xB7, 0xCD, 0x62, 0xB7, 0xB7, 0x28,
+  0x37, 0xFE, 0x81, 0xD2, 0x37, 0xB2, 0x4F, 0xCD,
+  0x62, 0xB7, 0x5F, 0xCD, 0x62, 0xB7, 0x57, 0x83,
+  0x81, 0x47, 0xCD, 0x62, 0xB7, 0x80, 0x20, 0x20,
+  0xCD, 0x62, 0xB7, 0x12, 0x13, 0x80, 0x47, 0x0D,
+  0x20, 0xF6, 0x7D, 0x2C, 0xCD, 0x38, 0xB7, 0x78,
+  0xCD, 0x38, 0xB7, 0x18, 0xCE, 0x4F, 0xDB, 0x0B,
+  0xE6, 0x04, 0x28, 0xFA, 0x79, 0xD3, 0x09, 0xC9,
+  0x3E, 0x01, 0xF3, 0xD3, 0x0B, 0xDB, 0x0B, 0xFB,
+  0x0F, 0x30, 0xF5, 0x01, 0x2E, 0x09, 0x21, 0x77,
+  0xB7, 0x3E, 0x47, 0xF3, 0xD3, 0x0D, 0x79, 0xD3,
+  0x0D, 0x0E, 0x0B, 0xED, 0xB3, 0xFB, 0xC9, 0xDB,
+  0x0B, 0x0F, 0x3F, 0x3E, 0x05, 0xF3, 0xD3, 0x0B,
+  0x3E, 0xD4, 0x1F, 0xD3, 0x0B, 0xFB, 0x07, 0x38,
+  0xEE, 0xDB, 0x09, 0xC9, 0x18, 0x04, 0x44, 0x03,
+  0xE1, 0x05, 0xEA, 0x11, 0x18, 0x00, 0xB2, 0xA5,
+  0x02, 0xC3, 0x03, 0xB2, 0xDB, 0x0A, 0x0F, 0x3F,
+  0x3E, 0x05, 0xF3, 0xD3, 0x0A, 0x3E, 0xD4, 0x1F,
+  0xD3, 0x0A, 0xFB, 0x07, 0x38, 0xEE, 0x3E, 0x1D,
+  0x32, 0x01, 0xB2, 0xDB, 0x08, 0xC9, 0xDB, 0x0B,
+  0x0F, 0x3F, 0x3E, 0x05, 0xF3, 0xD3, 0x0B, 0x3E,
+  0xD4, 0x1F, 0xD3, 0x0B, 0xFB, 0x07, 0x38, 0xEE,
+  0x3E, 0x03, 0x32, 0x01, 0xB2, 0xDB, 0x09, 0xC9,
+  0xFE, 0x83, 0xCA, 0xB7, 0xB2, 0xFE, 0x86, 0xCA,
+  0x28, 0xB3, 0xFE, 0x87, 0xCA, 0x79, 0xB4, 0xCD,
+  0x62, 0xB7, 0x4F, 0xCD, 0x62, 0xB7, 0x5F, 0xCD,
+  0x62, 0xB7, 0x57, 0x83, 0x81, 0x47, 0xCD, 0x62,
+  0xB7, 0x80, 0xC2, 0x43, 0xB7, 0xCD, 0x62, 0xB7,
+  0xFE, 0x80, 0x30, 0x11, 0x3C, 0x67, 0x79, 0xBC,
+  0xDA, 0x43, 0xB7, 0xCD, 0x62, 0xB7, 0xCD, 0x8B,
+  0xB2, 0x20, 0xF8, 0x18, 0x10, 0xD6, 0x7D, 0x67,
+  0x79, 0xBC, 0xDA, 0x43, 0xB7, 0xCD, 0x62, 0xB7,
+  0xCD, 0x8B, 0xB2, 0x20, 0xFB, 0x79, 0xB7, 0x20,
+  0xD4, 0xC3, 0x2D, 0xB7, 0x12, 0x80, 0x47, 0x1A,
+  0x13, 0x0D, 0x25, 0xC9, 0x79, 0x83, 0x82, 0xF5,
+  0xE5, 0x06, 0x80, 0x21, 0xFF, 0xFF, 0x1A, 0x13,
+  0xCD, 0x4A, 0xB4, 0x10, 0xF9, 0xC5, 0x7C, 0xCD,
+  0x38, 0xB7, 0x7D, 0xCD, 0x38, 0xB7, 0xC1, 0x0D,
+  0x20, 0xE7, 0xE1, 0xF1, 0x47, 0xC3, 0x2D, 0xB7,
+  0xCD, 0x62, 0xB7, 0x5F, 0xCD, 0x62, 0xB7, 0x57,
+  0x83, 0x67, 0xCD, 0x62, 0xB7, 0x84, 0x67, 0xC6,
+  0x83, 0x47, 0x7D, 0x2C, 0xCD, 0x38, 0xB7, 0x78,
+  0xCD, 0x38, 0xB7, 0x7C, 0xB7, 0xC2, 0x06, 0xB7,
+  0xE5, 0xCD, 0x04, 0xB3, 0x4B, 0xCD, 0x10, 0xB3,
+  0x01, 0x00, 0x00, 0xCD, 0x15, 0xB3, 0x38, 0x10,
+  0x81, 0x4F, 0x10, 0xF7, 0xCD, 0x38, 0xB7, 0xCD,
+  0x15, 0xB3, 0x38, 0x04, 0xFE, 0xA5, 0x28, 0x09,
+  0xCD, 0x15, 0xB3, 0x30, 0xFB, 0x4A, 0xCD, 0x10,
+  0xB3, 0xE1, 0xC3, 0x06, 0xB7, 0x3E, 0x01, 0xF3,
+  0xD3, 0x0B, 0xDB, 0x0B, 0xFB, 0x0F, 0x30, 0xF5,
+  0xC9, 0x06, 0x07, 0xC3, 0x51, 0xB7, 0x21, 0x00,
+  0x80, 0xDB, 0x0B, 0x0F, 0x38, 0x07, 0x2B, 0x7C,
+  0xB5, 0x20, 0xF6, 0x37, 0xC9, 0xDB, 0x09, 0xB7,
+  0xC9, 0xE5, 0x11, 0x00, 0xB5, 0x63, 0x2E, 0x00,
+  0x06, 0x08, 0x29, 0x30, 0x08, 0x7C, 0xEE, 0x10,
+  0x67, 0x7D, 0xEE, 0x21, 0x6F, 0x10, 0xF3, 0x7C,
+  0x12, 0x14, 0x7D, 0x12, 0x15, 0x1C, 0x20, 0xE5,
+  0x21, 0xFF, 0xFF, 0x22, 0xA3, 0xB4, 0x3E, 0xC3,
+  0x32, 0x06, 0xB7, 0x21, 0x5E, 0xB3, 0x22, 0x07,
+  0xB7, 0xE1, 0x06, 0x86, 0xC3, 0x2D, 0xB7, 0xCD,
+  0x62, 0xB7, 0x67, 0xCD, 0x62, 0xB7, 0x4F, 0xCD,
+  0x62, 0xB7, 0x5F, 0xCD, 0x62, 0xB7, 0x57, 0xCD,
+  0x62, 0xB7, 0x47, 0x84, 0x81, 0x83, 0x82, 0xFE,
+  0xA5, 0xC2, 0x18, 0xB4, 0x7C, 0xB7, 0xCA, 0x43,
+  0xB7, 0xFE, 0x82, 0xCA, 0x93, 0xB2, 0xE6, 0xF6,
+  0xFE, 0x84, 0xC2, 0x18, 0xB4, 0x79, 0x3D, 0xFE,
+  0x80, 0xD2, 0x18, 0xB4, 0x7C, 0xE5, 0xF5, 0x2A,
+  0xA3, 0xB4, 0xCD, 0x4A, 0xB4, 0x79, 0xCD, 0x4A,
+  0xB4, 0x7B, 0xCD, 0x4A, 0xB4, 0x7A, 0xCD, 0x4A,
+  0xB4, 0x78, 0xCD, 0x4A, 0xB4, 0xF1, 0xF5, 0x0F,
+  0x38, 0x0D, 0xCD, 0x62, 0xB7, 0x12, 0x13, 0xCD,
+  0x4A, 0xB4, 0x0D, 0x20, 0xF5, 0x18, 0x33, 0xCD,
+  0x62, 0xB7, 0xCD, 0x4A, 0xB4, 0xFE, 0x80, 0x30,
+  0x13, 0x3C, 0x47, 0x79, 0xB8, 0x38, 0x48, 0xCD,
+  0x62, 0xB7, 0xCD, 0x4A, 0xB4, 0x12, 0x13, 0x0D,
+  0x10, 0xF5, 0x18, 0x12, 0xD6, 0x7D, 0x47, 0x79,
+  0xB8, 0x38, 0x34, 0xCD, 0x62, 0xB7, 0xCD, 0x4A,
+  0xB4, 0x12, 0x13, 0x0D, 0x10, 0xFB, 0x79, 0xB7,
+  0x20, 0xCD, 0xF1, 0xE6, 0x08, 0x20, 0x07, 0x22,
+  0xA3, 0xB4, 0xE1, 0xC3, 0x5E, 0xB3, 0xEB, 0xE1,
+  0x7D, 0x2C, 0xCD, 0x38, 0xB7, 0x7A, 0xCD, 0x38,
+  0xB7, 0x7B, 0xCD, 0x38, 0xB7, 0x11, 0xFF, 0xFF,
+  0xED, 0x53, 0xA3, 0xB4, 0xC3, 0x5E, 0xB3, 0xF1,
+  0xE1, 0xE5, 0x3A, 0x62, 0xB7, 0xFE, 0xC3, 0x0E,
+  0x0B, 0xCD, 0x3F, 0xB4, 0x0E, 0x0A, 0xCC, 0x3F,
+  0xB4, 0xCD, 0x15, 0xB3, 0x30, 0xFB, 0x3A, 0x62,
+  0xB7, 0xFE, 0xC3, 0xCC, 0x59, 0xB4, 0x21, 0xFF,
+  0xFF, 0x22, 0xA3, 0xB4, 0xE1, 0xC3, 0x5E, 0xB3,
+  0x3E, 0x05, 0xF3, 0xED, 0x79, 0x3E, 0xEA, 0xED,
+  0x79, 0xFB, 0xC9, 0xD5, 0xF5, 0xAC, 0x5F, 0x16,
+  0xB5, 0x1A, 0xAD, 0x67, 0x14, 0x1A, 0x6F, 0xF1,
+  0xD1, 0xC9, 0xCD, 0x6A, 0xB4, 0xCD, 0x15, 0xB3,
+  0x30, 0xFB, 0xCD, 0x6A, 0xB4, 0x3E, 0x03, 0x32,
+  0x01, 0xB2, 0xC9, 0x21, 0x19, 0xB3, 0x7E, 0xEE,
+  0x01, 0x77, 0x21, 0x25, 0xB3, 0x7E, 0xEE, 0x01,
+  0x77, 0xC9, 0xCD, 0x62, 0xB7, 0x4F, 0xC6, 0x87,
+  0x47, 0xC5, 0xE5, 0x3E, 0x47, 0xF3, 0xD3, 0x0C,
+  0x79, 0xD3, 0x0C, 0x21, 0x77, 0xB7, 0x01, 0x0A,
+  0x07, 0xED, 0xB3, 0xFB, 0x3E, 0xC3, 0x32, 0x62,
+  0xB7, 0x21, 0x00, 0xB2, 0x22, 0x63, 0xB7, 0xE1,
+  0xC1, 0xC3, 0x2D, 0xB7, 0xFF, 0xFF
 };
 static const unsigned char v24boostrun[] = { 0x55, 0x00, 0xB7 }; /* 'U' B700 */
 static const unsigned char v24escape[]   = { 0x1B };
@@ -56,48 +189,236 @@ static const unsigned char v24mcload[]   = { 0x54 }; /* 'T' */
 
 static int            stdout_isterm;  /* log progress on standard output? */
 static int            portfd;         /* serial port file descriptor */
-static int            boostmode;      /* enable 19200 Baud transfer? */
+static int            stripefd;       /* serial port on channel A of the M003 module */
+static int            boostmode;      /* enable fast transfer? */
+static int            probemode;      /* probe the fastest boost rate? */
+static const BoostRate* boost_rate = &boost_rates[1]; /* current boost rate */
+static int            packmode;       /* compress blocks in boost mode? */
+static int            deltamode;      /* skip blocks already in KC memory? */
+static int            crcmode;        /* protect blocks by CRC? */
+static int            crcactive;      /* is the loader set up for CRC? */
+static int            stripemode;     /* stripe the data across both channels? */
+static int            striping;       /* does the loader take turns between the channels? */
+static unsigned int   stripe;         /* channel of the next byte while striping */
 static struct termios portattr;       /* serial port "terminal" settings */
+static unsigned int   blockseq;       /* number of the next acknowledgement from the loader */
+static int            acksync;        /* take the number of the next acknowledgement? */
+static unsigned int   nblocks;        /* blocks transferred in boost mode */
+static unsigned int   nretries;       /* blocks sent again after a checksum error */
+static unsigned int   nskipped;       /* blocks found unchanged in KC memory */
+static int            verbose;        /* report throughput and timing? */
+static double         boost_start;    /* time the boost loader was started */
+static double         boost_time;     /* seconds spent in boost mode */
+static double         drain_time;     /* seconds spent waiting in tcdrain() */
+static unsigned long  nbytes;         /* bytes of data acknowledged in boost mode */
+static unsigned int   rtt_histogram[RTT_BINS]; /* ack round trips by power of two ms */
+static volatile sig_atomic_t alarm_fired;
 
 static void
 exit_usage(void)
 {
-  fputs("Usage: kcsend [-p PORT] [-o OFFSET] [-l] [-n] [FILE]...\n", stderr);
+  fputs("Usage: kcsend [-p PORT] [-o OFFSET] [-t FORMAT] [-s PORT] [-b] [-c] [-d] [-l] [-n] [-r] [-v] [FILE]...\n", stderr);
+  exit(1);
+}
+
+static double
+monotonic_time(void)
+{
+  struct timespec ts;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+    kc_exit_error("clock");
+
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void
+handle_alarm(int signum)
+{
+  (void)signum;
+  alarm_fired = 1;
+}
+
+/* Report where the time of the transfer went: the effective rate of the
+ * boost mode, the time spent waiting for output to drain, and a histogram
+ * of the round trip times from writing a block to its acknowledgement.
+ */
+static void
+print_statistics(void)
+{
+  if (boost_start > 0.)
+  {
+    double elapsed = (boost_time > 0.) ? boost_time : monotonic_time() - boost_start;
+
+    printf("%lu bytes in %.1f s at the boost rate, %.0f bytes/s\n",
+           nbytes, elapsed, nbytes / elapsed);
+  }
+  printf("%.1f s waiting for output to drain\n", drain_time);
+
+  for (int i = 0; i < RTT_BINS; ++i)
+  {
+    if (rtt_histogram[i] == 0)
+      continue;
+
+    if (i == 0)
+      printf("%12s", "< 1 ms");
+    else if (i == RTT_BINS - 1)
+      printf("%5s%4u ms", ">= ", 1u << (i - 1));
+    else
+      printf("%4u-%4u ms", 1u << (i - 1), (1u << i) - 1);
+
+    printf(" %6u acks\n", rtt_histogram[i]);
+  }
+}
+
+/* Give up on a transfer the KC does not respond to.  Output still pending
+ * is discarded, so that closing the port does not wait for the handshake
+ * forever, and the port is switched back to the normal rate.
+ */
+static void G_GNUC_NORETURN
+abort_transfer(void)
+{
+  if (striping)
+  {
+    tcflush(stripefd, TCIOFLUSH);
+    close(stripefd);
+  }
+  tcflush(portfd, TCIOFLUSH);
+
+  cfsetispeed(&portattr, BAUDRATE_NORMAL);
+  cfsetospeed(&portattr, BAUDRATE_NORMAL);
+  tcsetattr(portfd, TCSANOW, &portattr);
+  close(portfd);
+
+  if (verbose)
+    print_statistics();
+
+  fputs("Transfer aborted\n", stderr);
   exit(1);
 }
 
+/* Wait for the serial port to become ready for the given events, and
+ * return 0 if it did not within timeout milliseconds.
+ */
+static int
+wait_port(int fd, short events, int timeout)
+{
+  struct pollfd pfd = { fd, events, 0 };
+  int           rc;
+
+  while ((rc = poll(&pfd, 1, timeout)) < 0)
+  {
+    if (errno != EINTR)
+      kc_exit_error("poll serial port");
+  }
+  return rc;
+}
+
+/* Wait until all output has been sent, on both ports while striping.  As
+ * tcdrain() has no timeout of its own, it is interrupted by an alarm after
+ * WRITE_TIMEOUT.
+ */
+static void
+drain_output(void)
+{
+  double start = monotonic_time();
+  int    fds[] = { portfd, stripefd };
+
+  alarm_fired = 0;
+  alarm((WRITE_TIMEOUT + 999) / 1000);
+
+  for (int i = 0; i < ((striping) ? 2 : 1); ++i)
+    while (tcdrain(fds[i]) < 0)
+    {
+      if (errno != EINTR)
+        kc_exit_error("drain output");
+
+      if (alarm_fired)
+      {
+        fputs("\rdrain output: KC not ready\n", stderr);
+        abort_transfer();
+      }
+    }
+  alarm(0);
+  drain_time += monotonic_time() - start;
+}
+
 static void
 change_baudrate(speed_t rate)
 {
+  drain_output();
+
   cfsetispeed(&portattr, rate);
   cfsetospeed(&portattr, rate);
 
-  if (tcsetattr(portfd, TCSADRAIN, &portattr) < 0)
+  if (tcsetattr(portfd, TCSADRAIN, &portattr) < 0
+      || (striping && tcsetattr(stripefd, TCSADRAIN, &portattr) < 0))
     kc_exit_error("change baudrate");
 }
 
 static void
-send_sequence(const unsigned char* data, ssize_t length)
+write_port(int fd, const unsigned char* data, ssize_t length)
 {
   ssize_t written = 0;
 
   while (written < length)
   {
-    ssize_t rc = write(portfd, &data[written], length - written);
+    ssize_t rc = write(fd, &data[written], length - written);
     if (rc >= 0)
       written += rc;
+    else if (errno == EAGAIN)
+    {
+      if (!wait_port(fd, POLLOUT, WRITE_TIMEOUT))
+      {
+        fputs("\rsend sequence: KC not ready\n", stderr);
+        abort_transfer();
+      }
+    }
     else if (errno != EINTR)
       kc_exit_error("send sequence");
   }
+}
 
-  while (tcdrain(portfd) < 0)
+/* Write data to the serial port.  While striping, the loader takes the
+ * bytes from channel A and B in turns, so they are dealt out to both ports
+ * in chunks small enough that neither line waits for the other for long.
+ */
+static void
+write_sequence(const unsigned char* data, ssize_t length)
+{
+  if (!striping)
   {
-    if (errno != EINTR)
-      kc_exit_error("send sequence");
+    write_port(portfd, data, length);
+    return;
+  }
+  ssize_t offset = 0;
+
+  while (offset < length)
+  {
+    unsigned char chunk[2][64];
+    ssize_t       count[2] = { 0, 0 };
+
+    while (offset < length && count[0] < 64 && count[1] < 64)
+    {
+      chunk[stripe][count[stripe]++] = data[offset++];
+      stripe ^= 1;
+    }
+    write_port(stripefd, chunk[0], count[0]);
+    write_port(portfd,   chunk[1], count[1]);
   }
 }
 
-static unsigned int
+static void
+send_sequence(const unsigned char* data, ssize_t length)
+{
+  write_sequence(data, length);
+  drain_output();
+}
+
+/* Read a byte from the serial port, or return -1 if none arrives within
+ * REPLY_TIMEOUT.
+ */
+static int
 receive_byte(void)
 {
   unsigned char byte;
@@ -105,7 +426,12 @@ receive_byte(void)
 
   while ((count = read(portfd, &byte, 1)) < 0)
   {
-    if (errno != EINTR)
+    if (errno == EAGAIN)
+    {
+      if (!wait_port(portfd, POLLIN, REPLY_TIMEOUT))
+        return -1;
+    }
+    else if (errno != EINTR)
       kc_exit_error("receive byte");
   }
   if (count == 0)
@@ -116,51 +442,846 @@ receive_byte(void)
   return byte;
 }
 
+static void
+show_progress(unsigned int blocknr, const char* indicator)
+{
+  if (stdout_isterm)
+  {
+    printf("\r%.2X%s", (blocknr + 2) & 0xFF, indicator);
+
+    if (verbose && boost_start > 0.)
+      printf(" %5.0f bytes/s", nbytes / (monotonic_time() - boost_start));
+
+    fflush(stdout);
+  }
+}
+
+/* Wait for the next acknowledgement from the boost loader.  Return 1 if
+ * the checksum matches, 0 if the block has to be sent again, or -1 if no
+ * reply arrived in time.  The loader replies with the block number modulo
+ * 256 followed by the checksum, or by the high and low byte of the CRC.
+ * After the loader has dropped blocks, the count is picked up from the
+ * next reply.  A reply which does not belong to the oldest
+ * block in flight is taken for a transmission error as well; should the
+ * replies really be out of step, the retries run out soon enough.  With
+ * CRC, the loader may have dropped a whole batch, so such a reply counts
+ * as missing and the sender goes back to resynchronize.
+ */
+static int
+receive_ack(unsigned int checksum, int crc)
+{
+  int acknr  = receive_byte();
+  int acksum = (acknr >= 0) ? receive_byte() : -1;
+
+  if (crc && acksum >= 0)
+  {
+    int acklow = receive_byte();
+
+    acksum = (acklow >= 0) ? acksum << 8 | acklow : -1;
+  }
+  if (acksum < 0)
+    return -1;
+
+  if (!crc)
+    checksum &= 0xFF;
+
+  if (acksync)
+  {
+    blockseq = acknr;
+    acksync  = 0;
+  }
+  if (acknr != (int)(blockseq++ & 0xFF))
+    return (crcactive) ? -1 : 0;
+
+  return (acksum == (int)checksum);
+}
+
+/* Compress a block with the run-length encoding understood by the loader
+ * extension, and return the length of the result, or 0 if it would not be
+ * shorter than maxlength.  A code n below 80h is followed by n + 1 literal
+ * bytes, and a code n from 80h up by one byte to be repeated n - 125 times.
+ */
+static size_t
+pack_block(const unsigned char* data, size_t length, unsigned char* out, size_t maxlength)
+{
+  size_t n = 0;
+  size_t i = 0;
+
+  while (i < length)
+  {
+    size_t count = 1;
+
+    while (i + count < length && count < 130 && data[i + count] == data[i])
+      ++count;
+
+    if (count >= 3)
+    {
+      if (n + 2 >= maxlength)
+        return 0;
+
+      out[n++] = count + 125;
+      out[n++] = data[i];
+      i += count;
+      continue;
+    }
+    size_t start = i;
+
+    // Collect literals up to the start of the next run.
+    for (count = 0; i < length && count < 128; ++i, ++count)
+    {
+      if (i + 2 < length && data[i + 1] == data[i] && data[i + 2] == data[i])
+        break;
+    }
+    if (n + 1 + count >= maxlength)
+      return 0;
+
+    out[n++] = count - 1;
+    memcpy(&out[n], &data[start], count);
+    n += count;
+  }
+  return n;
+}
+
+/* Update a CRC-16 with polynomial 1021h, as computed by the loader.
+ */
 static unsigned int
-send_kcfile(const char* filename, unsigned int loadoffset)
+update_crc(unsigned int crc, const unsigned char* data, size_t length)
 {
-  FILE*         kcfile;
-  unsigned char block[128];
+  for (size_t i = 0; i < length; ++i)
+  {
+    crc ^= (unsigned int)data[i] << 8;
 
-  if (filename[0] == '-' && filename[1] == '\0')
-    kcfile = stdin;
+    for (int bit = 0; bit < 8; ++bit)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc & 0xFFFF;
+}
+
+/* Compute the checksum of a 128 byte block as the loader extension does for
+ * a checksum request, in the order of the bytes sent back: the CRC of the
+ * block, high byte first.
+ */
+static unsigned int
+block_sums(const unsigned char* data)
+{
+  unsigned int crc = update_crc(0xFFFF, data, 128);
+
+  return crc >> 8 | (crc & 0xFF) << 8;
+}
+
+/* Compute the check byte which completes the header of a block with CRC.
+ * The header sums up to 0A5h rather than zero, so that the loader cannot
+ * take a run of zeros for the end of the transfer after losing track.
+ */
+static unsigned int
+header_check(const unsigned char* frame)
+{
+  return (0xA5 - (frame[0] + frame[1] + frame[2] + frame[3])) & 0xFF;
+}
+
+/* Recover from a reply which did not arrive in time with CRC.  The loader
+ * may still wait for the rest of a block whose run-length codes were
+ * damaged, so complete it with filler bytes first.  The filler never forms
+ * a valid header or code, and the loader drops everything after a damaged
+ * one until the line is quiet.  Then discard any stray input, and pick up
+ * the count of acknowledgements again with the next one.  While striping,
+ * the loader waits for each channel in turn, and starts over with A.
+ */
+static void
+resync_loader(void)
+{
+  unsigned char filler[5 + 2 * 128];
+
+  memset(filler, 0xFF, sizeof filler);
+  write_sequence(filler, sizeof filler);
+  drain_output();
+  poll(0, 0, (striping) ? 2 * REPLY_TIMEOUT : REPLY_TIMEOUT);
+
+  tcflush(portfd, TCIFLUSH);
+  acksync = 1;
+  stripe  = 0;
+}
+
+/* Ask the loader extension for the checksums of total blocks of 128 bytes
+ * in KC memory starting at address, for comparison with block_sums().
+ */
+static void
+query_blocks(unsigned int address, unsigned int total, unsigned int* sums)
+{
+  unsigned int done    = 0;
+  unsigned int retries = 0;
+
+  while (done < total)
+  {
+    unsigned int count  = MIN(total - done, 128);
+    unsigned int target = (address + 128 * done) & 0xFFFFu;
+
+    unsigned char frame[] = { 0x82, count, target & 0xFF, target >> 8, 0 };
+
+    frame[4] = header_check(frame);
+    write_sequence(frame, sizeof frame);
+    ++nblocks;
+
+    int ack = 1;
+
+    for (unsigned int i = 0; i < count && ack >= 0; ++i)
+    {
+      int sum    = receive_byte();
+      int sumsum = (sum >= 0) ? receive_byte() : -1;
+
+      if (sumsum < 0)
+        ack = -1;
+      sums[done + i] = sum | sumsum << 8;
+    }
+    if (ack >= 0)
+      ack = receive_ack(count + (target & 0xFF) + (target >> 8), 0);
+
+    if (ack > 0)
+    {
+      done += count;
+      retries = 0;
+    }
+    else if (++retries > BOOST_RETRIES)
+    {
+      fprintf(stderr, "\rchecksum request at %.4X failed\n", target);
+      abort_transfer();
+    }
+    else
+    {
+      if (ack < 0)
+        resync_loader();
+      ++nretries;
+    }
+  }
+}
+
+/* Transfer length bytes of data to the boost loader at the given address.
+ * Each block is preceded by its type or length and its target address.  Up
+ * to BOOST_WINDOW blocks are kept in flight without draining the output in
+ * between, so that the line does not sit idle for the round trip of each
+ * acknowledgement.  A block with a checksum error is queued up again for
+ * the same address, up to BOOST_RETRIES times.  If the checksums of the
+ * blocks already in KC memory are passed in, complete blocks which match
+ * are skipped.  With CRC, only every BOOST_BATCH blocks are acknowledged,
+ * and the blocks of a batch are sent again together.
+ */
+static void
+send_image(const unsigned char* data, unsigned int address, unsigned int length,
+           int progress, const unsigned int* remote)
+{
+  BoostBlock   window[BOOST_WINDOW];
+  unsigned int nsent  = 0;
+  unsigned int nacked = 0;
+  unsigned int nbatch = 0;
+  unsigned int crc    = 0xFFFF;
+  unsigned int offset = 0;
+  unsigned int last   = 0; /* offset of the last block to be sent */
+
+  for (unsigned int i = 0; i < length; i += 128)
+    if (!remote || length - i < 128 || remote[i / 128] != block_sums(&data[i]))
+      last = i;
+
+  while (nacked < nsent || offset < length)
+  {
+    if (nsent - nacked == BOOST_WINDOW || offset >= length)
+    {
+      BoostBlock*  oldest  = &window[nacked % BOOST_WINDOW];
+      unsigned int blocknr = ((oldest->address - address) & 0xFFFFu) / 128;
+      unsigned int count   = 1;
+
+      while (!window[(nacked + count - 1) % BOOST_WINDOW].ack)
+        ++count;
+
+      const BoostBlock* newest = &window[(nacked + count - 1) % BOOST_WINDOW];
+
+      int ack = receive_ack(newest->checksum, crcactive);
+
+      if (ack < 0 && crcactive && ++oldest->retries <= BOOST_RETRIES)
+      {
+        /* Go back to the oldest block, as the loader may have dropped
+         * any of the blocks in flight.
+         */
+        resync_loader();
+
+        if (progress)
+          show_progress(blocknr, "*");
+
+        nretries += nsent - nacked;
+
+        for (unsigned int i = nacked; i != nsent; ++i)
+        {
+          BoostBlock* block = &window[i % BOOST_WINDOW];
+
+          write_sequence(block->frame, block->size);
+          block->sent = monotonic_time();
+        }
+        continue;
+      }
+      if (ack < 0)
+      {
+        fprintf(stderr, "\rblock %.2X at %.4X: no acknowledgement\n",
+                (blocknr + 2) & 0xFF, oldest->address);
+        abort_transfer();
+      }
+      if (ack > 0)
+      {
+        unsigned int rtt = (monotonic_time() - newest->sent) * 1000.;
+        unsigned int bin = 0;
+
+        while (rtt > 0 && bin < RTT_BINS - 1)
+        {
+          rtt >>= 1;
+          ++bin;
+        }
+        ++rtt_histogram[bin];
+
+        for (unsigned int i = 0; i < count; ++i)
+        {
+          const BoostBlock* block = &window[nacked++ % BOOST_WINDOW];
+
+          nbytes += block->length;
+
+          if (progress)
+            show_progress(((block->address - address) & 0xFFFFu) / 128, ">");
+        }
+        continue;
+      }
+      if (++oldest->retries > BOOST_RETRIES)
+      {
+        fprintf(stderr, "\rblock %.2X at %.4X: checksum error\n",
+                (blocknr + 2) & 0xFF, oldest->address);
+        abort_transfer();
+      }
+      if (progress)
+        show_progress(blocknr, "*");
+
+      nretries += count;
+
+      /* The slots of the batch are free now, and copying in order never
+       * overwrites a block which is yet to be copied.
+       */
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        BoostBlock* block = &window[nacked++ % BOOST_WINDOW];
+        BoostBlock* retry = &window[nsent++ % BOOST_WINDOW];
+
+        if (retry != block)
+          *retry = *block;
+
+        write_sequence(retry->frame, retry->size);
+        retry->sent = monotonic_time();
+      }
+      continue;
+    }
+
+    BoostBlock*          block     = &window[nsent % BOOST_WINDOW];
+    const unsigned char* blockdata = &data[offset];
+    unsigned int         blocksize = MIN(length - offset, 128);
+    unsigned int         target    = (address + offset) & 0xFFFFu;
+    unsigned int         checksum  = blocksize + (target & 0xFF) + (target >> 8);
+    unsigned char*       frame     = block->frame;
+    unsigned char        packed[128];
+    size_t               packsize  = 0;
+    size_t               header    = 0;
+
+    if (remote && blocksize == 128 && remote[offset / 128] == block_sums(blockdata))
+    {
+      if (progress)
+        show_progress(offset / 128, ">");
+      offset += blocksize;
+      ++nskipped;
+      continue;
+    }
+
+    for (unsigned int i = 0; i < blocksize; ++i)
+      checksum += blockdata[i];
+
+    /* Without CRC, the frame of a packed block has one more byte of header.
+     */
+    if (packmode)
+      packsize = pack_block(blockdata, blocksize, packed, (crcactive) ? blocksize : blocksize - 1);
+
+    if (packsize > 0)
+      frame[header++] = (crcactive) ? 0x85 : 0x81; /* run-length encoded block */
+    else if (crcactive)
+      frame[header++] = 0x84; /* block with CRC */
+
+    frame[header++] = blocksize;
+    frame[header++] = target & 0xFF;
+    frame[header++] = target >> 8;
+
+    /* Without CRC, the check byte makes the sum of length and address zero.
+     */
+    if (!crcactive)
+      frame[header++] = -(blocksize + (target & 0xFF) + (target >> 8)) & 0xFF;
+
+    block->address  = target;
+    block->length   = blocksize;
+    block->checksum = checksum;
+    block->retries  = 0;
+    block->ack      = 1;
+
+    if (crcactive)
+    {
+      block->ack = (++nbatch == BOOST_BATCH || offset == last
+                    || nsent + 1 - nacked == BOOST_WINDOW);
+      if (block->ack)
+        frame[0] |= 0x08;
+
+      frame[header] = header_check(frame);
+      ++header;
+    }
+    if (packsize > 0)
+      memcpy(&frame[header], packed, packsize);
+    else
+      memcpy(&frame[header], blockdata, blocksize);
+
+    block->size = header + ((packsize > 0) ? packsize : blocksize);
+
+    if (crcactive)
+    {
+      crc = update_crc(crc, frame, block->size);
+
+      if (block->ack)
+      {
+        block->checksum = crc;
+        crc    = 0xFFFF;
+        nbatch = 0;
+      }
+    }
+    write_sequence(block->frame, block->size);
+    block->sent = monotonic_time();
+    offset += blocksize;
+    ++nsent;
+    ++nblocks;
+  }
+}
+
+/* Get the path of the file which remembers the boost rate found for each
+ * serial port, and return whether there is one.
+ */
+static int
+get_rate_cache_path(char* path, size_t size)
+{
+  const char* dir = getenv("XDG_CACHE_HOME");
+  int         n;
+
+  if (dir && dir[0] != '\0')
+    n = snprintf(path, size, "%s/kcsend-rates", dir);
+  else if ((dir = getenv("HOME")))
+    n = snprintf(path, size, "%s/.cache/kcsend-rates", dir);
   else
-    kcfile = fopen(filename, "rb");
+    return 0;
 
-  if (!kcfile || fread(&block, sizeof block, 1, kcfile) <= 0)
-    kc_exit_error(filename);
+  return (n > 0 && (size_t)n < size);
+}
+
+/* Return the baud rate on a line of the rate cache if the line belongs to
+ * the given port, or 0 otherwise.  Each line holds the rate followed by the
+ * name of the port.
+ */
+static unsigned long
+match_cache_line(const char* line, const char* portname)
+{
+  char*         name;
+  unsigned long baud = strtoul(line, &name, 10);
+  size_t        len  = strlen(portname);
+
+  name += strspn(name, " ");
 
-  int nargs = block[16];
-  unsigned int load = block[17] | (unsigned)block[18] << 8;
-  unsigned int end  = block[19] | (unsigned)block[20] << 8;
+  if (strncmp(name, portname, len) == 0 && (name[len] == '\n' || name[len] == '\0'))
+    return baud;
 
-  if (nargs < 2 || nargs > 10 || load >= end)
+  return 0;
+}
+
+static const BoostRate*
+load_boost_rate(const char* portname)
+{
+  char  path[PATH_MAX];
+  char  line[PATH_MAX + 16];
+  FILE* file;
+
+  const BoostRate* found = 0;
+
+  if (!get_rate_cache_path(path, sizeof path) || !(file = fopen(path, "r")))
+    return 0;
+
+  while (fgets(line, sizeof line, file))
   {
-    fprintf(stderr, "%s: invalid raw tape image header\n", filename);
-    exit(1);
+    unsigned long baud = match_cache_line(line, portname);
+
+    for (size_t i = 0; i < G_N_ELEMENTS(boost_rates); ++i)
+      if (baud == boost_rates[i].baud)
+        found = &boost_rates[i];
+  }
+  fclose(file);
+
+  return found;
+}
+
+/* Remember the current boost rate for the given port.  Failure to do so is
+ * not fatal, as the rate is merely probed again next time.
+ */
+static void
+save_boost_rate(const char* portname)
+{
+  char  path[PATH_MAX];
+  char  temp[PATH_MAX + 4];
+  char  line[PATH_MAX + 16];
+  FILE* file;
+
+  if (!get_rate_cache_path(path, sizeof path))
+    return;
+
+  snprintf(temp, sizeof temp, "%s.new", path);
+
+  if (!(file = fopen(temp, "w")) && errno == ENOENT)
+  {
+    char* dirsep = strrchr(path, '/');
+
+    *dirsep = '\0';
+    mkdir(path, 0700);
+    *dirsep = '/';
+
+    file = fopen(temp, "w");
+  }
+  if (!file)
+  {
+    fprintf(stderr, "%s: %s\n", temp, strerror(errno));
+    return;
+  }
+  FILE* oldfile = fopen(path, "r");
+
+  if (oldfile)
+  {
+    while (fgets(line, sizeof line, oldfile))
+      if (!match_cache_line(line, portname))
+        fputs(line, file);
+
+    fclose(oldfile);
+  }
+  fprintf(file, "%u %s\n", boost_rate->baud, portname);
+
+  if (fclose(file) != 0 || rename(temp, path) < 0)
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+}
+
+/* Ask the boost loader to switch over to another rate.  After the
+ * acknowledgement at the old rate, a test pattern is sent at the new rate,
+ * and the sum of its bytes has to come back intact for the new rate to be
+ * confirmed.  Otherwise, the loader returns to the old rate by itself once
+ * the line has been quiet for a while.
+ */
+static int
+try_boost_rate(const BoostRate* rate)
+{
+  unsigned int newtc = rate->timeconst;
+  unsigned int oldtc = boost_rate->timeconst;
+  unsigned int sum   = 0;
+
+  const unsigned char request[] = { 0x83, newtc, oldtc, -(newtc + oldtc) & 0xFF };
+  unsigned char       pattern[256];
+
+  for (unsigned int i = 0; i < sizeof pattern; ++i)
+  {
+    pattern[i] = i ^ ((i & 1) ? 0x55 : 0xAA);
+    sum += pattern[i];
+  }
+  write_sequence(request, sizeof request);
+
+  int ack = receive_ack(0x83, 0);
+
+  if (ack < 0)
+  {
+    fputs("\rrate change: no acknowledgement\n", stderr);
+    abort_transfer();
   }
+  if (ack > 0)
+  {
+    change_baudrate(rate->speed);
+    write_sequence(pattern, sizeof pattern);
+
+    if (receive_byte() == (int)(sum & 0xFF))
+    {
+      const unsigned char confirm[] = { 0xA5 };
+
+      send_sequence(confirm, sizeof confirm);
+      boost_rate = rate;
+      return 1;
+    }
+  }
+  poll(0, 0, PROBE_SETTLE);
+  change_baudrate(boost_rate->speed);
+  tcflush(portfd, TCIFLUSH);
+
+  return 0;
+}
+
+/* Load the boost loader into the cassette tape buffer, start it at the
+ * slowest boost rate, and switch over.  The extension of the loader is
+ * transferred along, unless it is not going to be used.  With a rate
+ * cached from an earlier session, the loader then changes straight to
+ * that rate, and only if it fails the test, probing steps up from the
+ * next slower rate.  Without one, the loader steps up to the fastest rate
+ * which passes the test.  The loader keeps running for all files of the
+ * session, as every block carries its target address anyway.  For
+ * striping, channel A is set up for the rate found on channel B, so both
+ * ports have to be wired up alike.  Return whether the rate has been
+ * probed, and is worth caching.  If no faster rate passes, the slowest one
+ * is cached, as the upload of the extension has just tested it.
+ */
+static int
+start_boost(const BoostRate* cached)
+{
+  const BoostRate* slowest = &boost_rates[G_N_ELEMENTS(boost_rates) - 1];
+  unsigned char    loader[5 + 128];
+  size_t           size   = 5 + (v24boostcode[3] | v24boostcode[4] << 8);
+  int              probed = 0;
+
+  boost_rate = slowest;
+
+  memcpy(loader, v24boostcode, size);
+  loader[6] = boost_rate->timeconst; /* ld bc,0100h * v24il + timeconst */
+
   send_sequence(v24escape, sizeof v24escape);
+  send_sequence(loader, size);
+  send_sequence(v24escape, sizeof v24escape);
+  send_sequence(v24boostrun, sizeof v24boostrun);
+  change_baudrate(boost_rate->speed);
+
+  boost_start = monotonic_time();
+  acksync     = 1;
+
+  if (packmode || deltamode || crcmode || stripemode || cached != slowest)
+  {
+    const unsigned char* ext  = &v24boostcode[size];
+    int                  pack = packmode;
+
+    // Packed blocks are unpacked by the extension, which is not there yet.
+    packmode = 0;
+    send_image(&ext[4], ext[0] | ext[1] << 8, ext[2] | ext[3] << 8, 0, 0);
+    packmode = pack;
+  }
+  if (!cached || (cached != slowest && !try_boost_rate(cached)))
+  {
+    if (cached && stdout_isterm)
+      printf("Cached boost rate %u Baud failed, probing\n", cached->baud);
+
+    for (const BoostRate* rate = (cached) ? cached + 1 : boost_rates; rate < slowest; ++rate)
+      if (try_boost_rate(rate))
+        break;
+
+    probed = 1;
+  }
+  if (stdout_isterm)
+    printf("Boost rate %u Baud\n", boost_rate->baud);
+
+  if (stripemode)
+  {
+    unsigned int        timeconst = boost_rate->timeconst;
+    const unsigned char setup[]   = { 0x87, timeconst };
+
+    if (tcsetattr(stripefd, TCSANOW, &portattr) < 0)
+      kc_exit_error("change baudrate");
+
+    write_sequence(setup, sizeof setup);
+
+    if (receive_ack(0x87 + timeconst, 0) <= 0)
+    {
+      fputs("\rstriping setup failed\n", stderr);
+      abort_transfer();
+    }
+    striping = 1;
+    stripe   = 0;
+  }
+  // The loader answers the checksum requests of the delta mode with the
+  // CRC, which tells apart blocks that simple sums would not.
+  if (crcmode || deltamode)
+  {
+    const unsigned char setup[] = { 0x86 };
+
+    write_sequence(setup, sizeof setup);
+
+    if (receive_ack(0x86, 0) <= 0)
+    {
+      fputs("\rCRC setup failed\n", stderr);
+      abort_transfer();
+    }
+    crcactive = 1;
+  }
+  return probed;
+}
+
+/* Tell the boost loader to return, and switch back to the normal rate.  With
+ * CRC, the end marker is a complete header.
+ */
+static void
+stop_boost(void)
+{
+  const unsigned char epilog[] = { 0, 0, 0, 0, 0xA5 };
+
+  write_sequence(epilog, (crcactive) ? 5 : 1);
+  change_baudrate(BAUDRATE_NORMAL);
+  striping = 0;
+
+  boost_time = monotonic_time() - boost_start;
+}
+
+/* Read length bytes of file data into the image.  The first inblock bytes
+ * are taken from the rest of the start block.  In the TAP format, each of
+ * the following blocks is preceded by its block number.  Return the number
+ * of bytes actually read.
+ */
+static unsigned int
+read_file_data(FILE* kcfile, const char* filename, int tap, const unsigned char* block,
+               unsigned int inblock, unsigned char* image, unsigned int length)
+{
+  unsigned int count = MIN(length, inblock);
+
+  memcpy(image, block, count);
+
+  if (!tap)
+    count += fread(&image[count], 1, length - count, kcfile);
+  else
+    while (count < length)
+    {
+      unsigned char record[1 + 128];
+
+      if (fread(record, sizeof record, 1, kcfile) == 0)
+        break;
+
+      unsigned int n = MIN(length - count, 128);
+
+      memcpy(&image[count], &record[1], n);
+      count += n;
+    }
+
+  if (ferror(kcfile))
+    kc_exit_error(filename);
+
+  return count;
+}
+
+/* Check whether the target range of a transfer overlaps the memory taken
+ * up by the boost loader, from its extension up to the end of the resident
+ * part in the cassette tape buffer.
+ */
+static int
+overlaps_loader(unsigned int address, unsigned int length)
+{
+  size_t       size  = 5 + (v24boostcode[3] | v24boostcode[4] << 8);
+  unsigned int first = v24boostcode[size] | v24boostcode[size + 1] << 8;
+  unsigned int last  = (v24boostcode[1] | v24boostcode[2] << 8) + size - 5 - 1;
+  unsigned int end   = address + length - 1; /* may wrap around past FFFFh */
 
+  if (length == 0)
+    return 0;
+
+  return ((address <= last && end >= first) || end >= 0x10000 + first);
+}
+
+/* Transfer length bytes of the image to KC memory at the given address.
+ * An image which would overwrite the boost loader is sent at the normal
+ * rate, and the loader is not started again for the rest of the session.
+ */
+static void
+send_data(const unsigned char* image, unsigned int address, unsigned int length,
+          int progress)
+{
+  if (boostmode && overlaps_loader(address, length))
+  {
+    if (stdout_isterm)
+      printf("Image at %.4X overlaps the boost loader, boost disabled\n", address);
+
+    stop_boost();
+    boostmode = 0;
+  }
   if (boostmode)
   {
-    send_sequence(v24boostrun, sizeof v24boostrun);
-    change_baudrate(BAUDRATE_BOOST);
+    static unsigned int sums[0x10000 / 128];
+
+    if (deltamode)
+      query_blocks(address, length / 128, sums);
+
+    send_image(image, address, length, progress, (deltamode) ? sums : 0);
   }
   else
+  {
+    const unsigned char prolog[] = { address & 0xFF, address >> 8, length & 0xFF, length >> 8 };
+
+    send_sequence(v24escape, sizeof v24escape);
     send_sequence(v24mcload, sizeof v24mcload); /* just the 'T' command */
+    send_sequence(prolog, sizeof prolog);
 
-  unsigned int length = end - load;
+    for (unsigned int offset = 0; offset < length; offset += 128)
+    {
+      send_sequence(&image[offset], MIN(length - offset, 128));
 
-  load = (load + loadoffset) & 0xFFFFu;
-  end  = (end  + loadoffset) & 0xFFFFu;
+      if (progress)
+        show_progress(offset / 128, ">");
+    }
+  }
+}
 
-  unsigned int start = 0xFFFF;
+/* Load a program given by its start block, and return its start address,
+ * or 0xFFFF if it has none.  A machine code program is loaded to the
+ * address in its header, moved by loadoffset.  A KC-BASIC program goes to
+ * the start of BASIC program memory, and the pointers to the end of the
+ * program are set up as the interpreter would after loading it from tape.
+ */
+static unsigned int
+send_program(FILE* kcfile, const char* filename, int tap, const unsigned char* block,
+             unsigned int loadoffset)
+{
+  static unsigned char image[0x10000];
+
+  int          basic   = kc_is_basic_signature(block);
+  unsigned int start   = 0xFFFF;
+  unsigned int inblock = 0;
+  unsigned int load;
+  unsigned int length;
+
+  if (basic)
+  {
+    if ((block[0] & 0xFB) != 0xD3)
+    {
+      fprintf(stderr, "%s: KC-BASIC data can only be loaded by the interpreter\n",
+              filename);
+      exit(1);
+    }
+    load   = BASIC_PROGRAM;
+    length = block[11] | (unsigned)block[12] << 8;
+
+    if (length > 0x10000 - load)
+    {
+      fprintf(stderr, "%s: invalid KC-BASIC start block\n", filename);
+      exit(1);
+    }
+    if (tap)
+      inblock = 128 - 13;
+  }
+  else
+  {
+    int          nargs = block[16];
+    unsigned int end   = block[19] | (unsigned)block[20] << 8;
 
-  if (nargs >= 3)
-    start = block[21] | (unsigned)block[22] << 8;
+    load = block[17] | (unsigned)block[18] << 8;
 
-  if (nargs == 3)
-    start = (start + loadoffset) & 0xFFFFu;
+    if (nargs < 2 || nargs > 10 || load >= end)
+    {
+      fprintf(stderr, "%s: invalid raw tape image header\n", filename);
+      exit(1);
+    }
+    length = end - load;
+    load   = (load + loadoffset) & 0xFFFFu;
+
+    if (nargs >= 3)
+      start = block[21] | (unsigned)block[22] << 8;
+
+    if (nargs == 3)
+      start = (start + loadoffset) & 0xFFFFu;
+  }
 
   if (stdout_isterm)
   {
@@ -170,71 +1291,126 @@ send_kcfile(const char* filename, unsigned int loadoffset)
       name[i] = kc_to_wide_char(block[i]);
     name[11] = L'\0';
 
-    printf("%ls %.4X %.4X", name, load, end);
+    printf("%ls %.4X %.4X", name, load, (load + length) & 0xFFFFu);
 
-    if (nargs >= 3)
+    if (start < 0xFFFF)
       printf(" %.4X", start);
 
     fputs("\n01>", stdout);
     fflush(stdout);
   }
 
-  const unsigned char prolog[] = { load & 0xFF, load >> 8, length & 0xFF, length >> 8 };
-  send_sequence(prolog, sizeof prolog);
-
-  unsigned int offset = 0;
+  if (read_file_data(kcfile, filename, tap, &block[128 - inblock], inblock,
+                     image, length) < length)
+  {
+    fprintf(stderr, "\r%s: premature end of file\n", filename);
+    exit(1);
+  }
+  send_data(image, load, length, 1);
 
-  while (offset < length)
+  if (basic)
   {
-    size_t blocksize = length - offset;
-    if (blocksize > sizeof block)
-      blocksize = sizeof block;
-    size_t nread = fread(block, 1, blocksize, kcfile);
+    unsigned int end = load + length;
 
-    if (nread == 0)
-      break;
-    offset += nread;
-    send_sequence(block, nread);
+    const unsigned char pointers[] = { end & 0xFF, end >> 8, end & 0xFF, end >> 8,
+                                       end & 0xFF, end >> 8 };
+    send_data(pointers, BASIC_POINTERS, sizeof pointers, 0);
+  }
 
-    const char* indicator = ">";
+  if (stdout_isterm)
+    puts("\rFF>");
 
-    if (boostmode)
-    {
-      unsigned int checksum = 0;
+  return start;
+}
+
+/* Load all programs of a file in the given format, and return the start
+ * address of the last one.  A TAP image may hold several programs, each
+ * of which starts with block number 0 or 1.
+ */
+static unsigned int
+send_kcfile(const char* filename, KCFileFormat format, unsigned int loadoffset)
+{
+  FILE*         kcfile;
+  unsigned char block[128];
+  unsigned int  start = 0xFFFF;
 
-      for (size_t i = 0; i < nread; ++i)
-        checksum += block[i];
+  if (format == KC_FORMAT_ANY)
+  {
+    format = kc_format_from_filename(filename);
+
+    if (format == KC_FORMAT_ANY)
+      format = KC_FORMAT_KCC;
+  }
 
-      if (receive_byte() != (checksum & 0xFF))
-        indicator = "*\n"; /* checksum error */
+  if (filename[0] == '-' && filename[1] == '\0')
+    kcfile = stdin;
+  else
+    kcfile = fopen(filename, "rb");
+
+  if (!kcfile)
+    kc_exit_error(filename);
+
+  switch (KC_BASE_FORMAT(format))
+  {
+    case KC_FORMAT_TAP:
+    {
+      int nprograms = 0;
+
+      if (fread(block, KC_TAP_MAGIC_LEN + 1, 1, kcfile) <= 0)
+        kc_exit_error(filename);
+
+      if (memcmp(block, KC_TAP_MAGIC, KC_TAP_MAGIC_LEN) != 0)
+      {
+        fprintf(stderr, "%s: TAP file ID not found\n", filename);
+        exit(1);
+      }
+      int blocknr = block[KC_TAP_MAGIC_LEN];
+
+      while (fread(block, sizeof block, 1, kcfile) > 0)
+      {
+        if (blocknr <= 1)
+        {
+          start = send_program(kcfile, filename, 1, block, loadoffset);
+          ++nprograms;
+        }
+        if ((blocknr = getc(kcfile)) == EOF)
+          break;
+      }
+      if (ferror(kcfile))
+        kc_exit_error(filename);
+
+      if (nprograms == 0)
+      {
+        fprintf(stderr, "%s: no start block found in TAP file\n", filename);
+        exit(1);
+      }
+      break;
     }
-    if (stdout_isterm)
+    case KC_FORMAT_KCC:
     {
-      if (nread != blocksize)
-        indicator = "*\n"; /* end of file error */
+      if (fread(block, sizeof block, 1, kcfile) <= 0)
+        kc_exit_error(filename);
 
-      printf("\r%.2X%s", (offset / 128 + 1) & 0xFF, indicator);
-      fflush(stdout);
+      start = send_program(kcfile, filename, 0, block, loadoffset);
+      break;
     }
+    case KC_FORMAT_SSS:
+    {
+      kc_filename_to_tape(format, filename, block);
+
+      if (fread(&block[11], 2, 1, kcfile) <= 0)
+        kc_exit_error(filename);
 
-    if (nread == 0)
+      start = send_program(kcfile, filename, 0, block, loadoffset);
       break;
+    }
+    default:
+      abort();
   }
 
   if (kcfile != stdin && fclose(kcfile) != 0)
     kc_exit_error(filename);
 
-  if (offset == length && stdout_isterm)
-    puts("\rFF>");
-
-  if (boostmode)
-    change_baudrate(BAUDRATE_NORMAL);
-
-  if (offset < length)
-  {
-    fprintf(stderr, "\r%s: premature end of file\n", filename);
-    exit(1);
-  }
   return start;
 }
 
@@ -278,21 +1454,31 @@ int
 main(int argc, char** argv)
 {
   const char*  portname   = "/dev/ttyS0";
+  const char*  stripename = 0;
   unsigned int loadoffset = 0;
+  KCFileFormat format     = KC_FORMAT_ANY;
   int          autostart  = 1;
   int          c;
 
   boostmode = 1;
+  packmode  = 1;
   stdout_isterm = isatty(STDOUT_FILENO);
 
   setlocale(LC_ALL, "");
 
-  while ((c = getopt(argc, argv, "p:o:ln?")) != -1)
+  while ((c = getopt(argc, argv, "p:o:t:s:bcdlnrv?")) != -1)
     switch (c)
     {
       case 'p': portname   = optarg; break;
+      case 's': stripename = optarg; break;
+      case 'b': probemode  = 1; break;
+      case 'c': crcmode    = 1; break;
+      case 'd': deltamode  = 1; break;
       case 'l': boostmode  = 0; break;
       case 'n': autostart  = 0; break;
+      case 'r': packmode   = 0; break;
+      case 't': format     = kc_parse_arg_format(optarg); break;
+      case 'v': verbose    = 1; break;
       case 'o': loadoffset = (kc_parse_arg_int(optarg, -0xFFFF, 0xFFFF) + 0x10000) & 0xFFFFu; break;
       case '?': exit_usage();
       default:  abort();
@@ -307,22 +1493,49 @@ main(int argc, char** argv)
 
   init_serial_port(portname);
 
-  int flags = fcntl(portfd, F_GETFL, 0);
-  if (flags < 0 || fcntl(portfd, F_SETFL, flags & ~O_NONBLOCK) < 0)
-    kc_exit_error(portname);
+  /* The second port is wired to channel A, which only the boost loader
+   * knows how to use.  It gets the same settings as the first one.
+   */
+  if (stripename && boostmode)
+  {
+    int mainfd = portfd;
+
+    portfd = open(stripename, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (portfd < 0)
+      kc_exit_error(stripename);
+
+    init_serial_port(stripename);
+
+    stripefd   = portfd;
+    portfd     = mainfd;
+    stripemode = 1;
+  }
+
+  struct sigaction action;
+
+  memset(&action, 0, sizeof action);
+  action.sa_handler = &handle_alarm;
+  sigemptyset(&action.sa_mask);
+
+  if (sigaction(SIGALRM, &action, 0) < 0)
+    kc_exit_error("sigaction");
 
   if (stdout_isterm)
     printf("Using serial port %s\n", portname);
 
-  if (boostmode)
-  {
-    send_sequence(v24escape, sizeof v24escape);
-    send_sequence(v24boostcode, sizeof v24boostcode);
-  }
+  if (stripemode && stdout_isterm)
+    printf("Striping across serial port %s\n", stripename);
+
+  if (boostmode && start_boost((probemode) ? 0 : load_boost_rate(portname)))
+    save_boost_rate(portname);
+
   unsigned int start = 0xFFFF;
 
   for (int i = optind; i < argc; ++i)
-    start = send_kcfile(argv[i], loadoffset);
+    start = send_kcfile(argv[i], format, loadoffset);
+
+  if (boostmode)
+    stop_boost();
 
   if (autostart && start < 0xFFFF)
   {
@@ -331,8 +1544,21 @@ main(int argc, char** argv)
     send_sequence(v24escape, sizeof v24escape);
     send_sequence(v24exec,   sizeof v24exec);
   }
+  if (stripemode && close(stripefd) < 0)
+    kc_exit_error(stripename);
+
   if (close(portfd) < 0)
     kc_exit_error(portname);
 
+  if (deltamode && stdout_isterm)
+    printf("%u blocks unchanged\n", nskipped);
+
+  if (nretries > 0)
+    fprintf(stderr, "%u of %u blocks sent again after checksum errors\n",
+            nretries, nblocks);
+
+  if (verbose)
+    print_statistics();
+
   return 0;
 }
@@ -0,0 +1,967 @@
+/*
+ * Copyright (c) 2008-2010  Daniel Elstner <daniel.kitta@gmail.com>
+ *
+ * KC-Rec is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KC-Rec is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <build/config.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libkc/libkc.h>
+#include <cli/kcrec.h>
+
+/* Open-addressing hash table of 64-bit keys, each with an optional string.
+ * The key 0 marks an empty slot.
+ */
+typedef struct
+{
+  uint64_t*     keys;
+  char**        values;
+  size_t        size;
+  size_t        count;
+}
+HashIndex;
+
+/* A recording found in batch mode, not decoded yet.
+ */
+typedef struct
+{
+  char*         path;
+  off_t         size;
+}
+BatchInput;
+
+/* Queue of recordings to be decoded by a batch worker thread.  Each worker
+ * takes the recordings from the front of its own queue, and then steals from
+ * the back of the other queues until all of them have run dry.
+ */
+typedef struct
+{
+  pthread_mutex_t lock;
+  pthread_t       thread;
+  BatchInput**    inputs;
+  size_t          head;
+  size_t          tail;
+}
+BatchQueue;
+
+/* A file recovered from a recording in batch mode.
+ */
+typedef struct
+{
+  uint8_t       header[128]; // start block
+  KCFileFormat  format;
+  int           nblocks;
+  const char*   error;
+  int           truncated;   // cut off by the end of the recording?
+  BlockHealth   health;
+  char*         data;
+  size_t        size;
+}
+BatchProgram;
+
+enum { CATALOG_FIELDS = 11, CATALOG_HASH = 9, CATALOG_FILE = 10 };
+
+static FILE*             batchfile;
+static pthread_mutex_t   batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int               batch_log;          // log progress on standard output?
+static HashIndex         done_inputs;        // path hashes of recordings in the catalog
+static HashIndex         stored_programs;    // file names by content hash
+static BatchInput*       batch_inputs;
+static size_t            n_batch_inputs;
+static size_t            n_batch_skipped;
+static BatchQueue*       batch_queues;
+static unsigned int      n_batch_queues;
+static int               n_batch_failed;
+static void            (*batch_job)(const BatchInput* input);
+
+/* Compute the 64-bit FNV-1a hash of a block of memory.
+ */
+static uint64_t
+hash_bytes(const void* data, size_t size)
+{
+  const uint8_t* bytes = data;
+  uint64_t       hash  = UINT64_C(0xCBF29CE484222325);
+
+  for (size_t i = 0; i < size; ++i)
+    hash = (hash ^ bytes[i]) * UINT64_C(0x100000001B3);
+
+  return hash;
+}
+
+static size_t
+index_find(const HashIndex* index, uint64_t key)
+{
+  size_t i = key & (index->size - 1);
+
+  while (index->keys[i] != 0 && index->keys[i] != key)
+    i = (i + 1) & (index->size - 1);
+
+  return i;
+}
+
+/* Look up a key.  Return 1 and store its string in *value if found.
+ */
+static int
+index_lookup(const HashIndex* index, uint64_t key, const char** value)
+{
+  key += (key == 0);
+
+  if (index->size == 0)
+    return 0;
+
+  size_t i = index_find(index, key);
+
+  if (index->keys[i] == 0)
+    return 0;
+
+  if (value)
+    *value = index->values[i];
+
+  return 1;
+}
+
+/* Insert a key unless it is present already.  The string is copied.
+ */
+static void
+index_insert(HashIndex* index, uint64_t key, const char* value)
+{
+  key += (key == 0);
+
+  if (2 * (index->count + 1) > index->size)
+  {
+    HashIndex old = *index;
+
+    index->size   = MAX(64u, 2 * old.size);
+    index->keys   = calloc(index->size, sizeof index->keys[0]);
+    index->values = calloc(index->size, sizeof index->values[0]);
+
+    if (!index->keys || !index->values)
+      kc_exit_error("catalog index");
+
+    for (size_t i = 0; i < old.size; ++i)
+      if (old.keys[i] != 0)
+      {
+        size_t k = index_find(index, old.keys[i]);
+
+        index->keys[k]   = old.keys[i];
+        index->values[k] = old.values[i];
+      }
+    free(old.keys);
+    free(old.values);
+  }
+  size_t i = index_find(index, key);
+
+  if (index->keys[i] == 0)
+  {
+    index->keys[i]   = key;
+    index->values[i] = (value) ? strdup(value) : 0;
+    ++index->count;
+  }
+}
+
+/* Read the catalog written by earlier runs, if any.  Remember the recordings
+ * decoded already, and the files stored already.
+ */
+static void
+load_catalog(void)
+{
+  FILE* file = fopen(batchname, "r");
+
+  if (!file)
+  {
+    if (errno != ENOENT)
+      kc_exit_error(batchname);
+    return;
+  }
+  char*  line = 0;
+  size_t size = 0;
+
+  while (getline(&line, &size, file) >= 0)
+  {
+    char* fields[CATALOG_FIELDS];
+    char* state = 0;
+    int   n     = 0;
+
+    if (line[0] == '#')
+      continue;
+
+    for (char* f = strtok_r(line, "\t\n", &state); f && n < CATALOG_FIELDS;
+         f = strtok_r(0, "\t\n", &state))
+      fields[n++] = f;
+
+    if (n < CATALOG_FIELDS)
+      continue;
+
+    index_insert(&done_inputs, hash_bytes(fields[0], strlen(fields[0])), 0);
+
+    if (strcmp(fields[CATALOG_FILE], "-") != 0)
+      index_insert(&stored_programs, strtoull(fields[CATALOG_HASH], 0, 16),
+                   fields[CATALOG_FILE]);
+  }
+  if (ferror(file))
+    kc_exit_error(batchname);
+
+  free(line);
+  fclose(file);
+}
+
+static void
+add_input(const char* path, off_t size)
+{
+  if ((n_batch_inputs & (n_batch_inputs + 1)) == 0)
+  {
+    batch_inputs = realloc(batch_inputs, (2 * n_batch_inputs + 1) * sizeof batch_inputs[0]);
+
+    if (!batch_inputs)
+      kc_exit_error("batch inputs");
+  }
+  batch_inputs[n_batch_inputs].path = strdup(path);
+  batch_inputs[n_batch_inputs].size = size;
+  ++n_batch_inputs;
+}
+
+/* Add a file found in one of the directory trees to the batch, provided it
+ * looks like a recording, and is not in the catalog yet.
+ */
+static int
+add_batch_input(const char* path, const struct stat* st, int type, struct FTW* ftw)
+{
+  uint8_t header[TRACE_MAGIC_LEN + 4];
+  FILE*   file;
+  int     found = 0;
+
+  (void)ftw;
+
+  // Tabs and line breaks in the path would garble the catalog.
+  if (type != FTW_F || !S_ISREG(st->st_mode) || strpbrk(path, "\t\n"))
+    return 0;
+
+  if (!(file = fopen(path, "rb")))
+  {
+    perror(path);
+    return 0;
+  }
+  if (fread(header, 12, 1, file) == 1)
+    found = (memcmp(header, TRACE_MAGIC, TRACE_MAGIC_LEN) == 0
+             || (memcmp(header, "RIFF", 4) == 0 && memcmp(&header[8], "WAVE", 4) == 0));
+  fclose(file);
+
+  if (!found)
+    return 0;
+
+  if (index_lookup(&done_inputs, hash_bytes(path, strlen(path)), 0))
+    ++n_batch_skipped;
+  else
+    add_input(path, st->st_size);
+
+  return 0;
+}
+
+static int
+compare_input_size(const void* a, const void* b)
+{
+  off_t size_a = ((const BatchInput*)a)->size;
+  off_t size_b = ((const BatchInput*)b)->size;
+
+  return (size_a < size_b) - (size_a > size_b);
+}
+
+/* Take the next recording off the worker's own queue, or else steal one from
+ * another queue.  Return 0 when all queues are empty.
+ */
+static BatchInput*
+take_input(unsigned int self)
+{
+  for (unsigned int i = 0; i < n_batch_queues; ++i)
+  {
+    BatchQueue* queue = &batch_queues[(self + i) % n_batch_queues];
+    BatchInput* input = 0;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if (queue->head < queue->tail)
+      input = (i == 0) ? queue->inputs[queue->head++] : queue->inputs[--queue->tail];
+
+    pthread_mutex_unlock(&queue->lock);
+
+    if (input)
+      return input;
+  }
+  return 0;
+}
+
+static void
+format_address(char* buf, const uint8_t* bytes, int present)
+{
+  if (present)
+    sprintf(buf, "%.4X", bytes[0] | (unsigned)bytes[1] << 8);
+  else
+    strcpy(buf, "-");
+}
+
+/* Write the catalog entry of one file.  An intact file is stored in the
+ * catalog directory, unless a file with the same content is there already.
+ * Must be called with the batch lock held.
+ */
+static void
+catalog_program(const char* path, const BatchProgram* prog)
+{
+  const uint8_t* block = prog->header;
+  const char*    file  = "-";
+  const char*    state = "ok";
+  char           hash[17] = "-";
+  char           name[8 * MB_LEN_MAX + 1];
+  char           extension[4];
+  char           load[5], end[5], start[5];
+  char           stored[PATH_MAX];
+
+  if (get_tape_name(block, prog->format, name) == 0)
+    strcpy(name, "-");
+
+  get_tape_extension(block, prog->format, extension);
+
+  int is_kcc = (KC_BASE_FORMAT(prog->format) == KC_FORMAT_KCC);
+
+  format_address(load,  &block[17], is_kcc);
+  format_address(end,   &block[19], is_kcc);
+  format_address(start, &block[21], is_kcc && block[16] >= 3);
+
+  if (prog->truncated)
+    state = "truncated";
+  else if (prog->error)
+    state = (prog->health.status < BLOCK_TIMEOUT) ? block_status_names[-prog->health.status]
+                                                   : "sequence";
+  else
+  {
+    uint64_t value = hash_bytes(prog->data, prog->size);
+
+    if (prog->health.ncombined > 0)
+      state = "combined";
+
+    sprintf(hash, "%.16llX", (unsigned long long)value);
+
+    if (!index_lookup(&stored_programs, value, &file))
+    {
+      FILE* kcfile = create_extracted_file(block, prog->format, stored, sizeof stored);
+
+      if (fwrite(prog->data, prog->size, 1, kcfile) == 0 || fclose(kcfile) != 0)
+        kc_exit_error(stored);
+
+      file = strrchr(stored, '/') + 1;
+      index_insert(&stored_programs, value, file);
+    }
+  }
+  fprintf(batchfile, "%s\t%s\t%s\t%s\t%s\t%s\t%u/%d\t%s\t%.3f\t%s\t%s\n",
+          path, name, extension, load, end, start, prog->health.nblocks, prog->nblocks,
+          state, prog->health.min_margin, hash, file);
+}
+
+/* Open a recording for decoding by the calling worker thread.  Return 0 if
+ * it cannot be decoded, after reporting why.
+ */
+static int
+open_recording(const BatchInput* input)
+{
+  const char* error = open_input(input->path);
+
+  if (!error && channel >= n_channels)
+    error = (diversity) ? "Not a stereo recording" : "Channel number out of range";
+
+  if (error)
+  {
+    if (infile)
+      fclose(infile);
+
+    pthread_mutex_lock(&batch_lock);
+    fprintf(stderr, "%s: %s, skipped\n", input->path, error);
+    ++n_batch_failed;
+    pthread_mutex_unlock(&batch_lock);
+    return 0;
+  }
+  init_decoding();
+  init_stream(&stream, infile, 0);
+
+  return 1;
+}
+
+/* Decode one recording of the batch, and add what was found to the catalog.
+ * The recording is entered into the catalog only once it has been decoded
+ * completely, so that an interrupted run picks it up again.  A recording
+ * that ends in the middle of a file counts as failed, but the files found
+ * up to there are cataloged.
+ */
+static void
+decode_recording(const BatchInput* input)
+{
+  BatchProgram* programs  = 0;
+  size_t        nprograms = 0;
+  int           truncated = 0;
+
+  if (!open_recording(input))
+    return;
+
+  for (;;)
+  {
+    uint8_t block[128];
+
+    health.nblocks    = 0;
+    health.ncombined  = 0;
+    health.status     = 0;
+    health.min_margin = HUGE_VAL;
+
+    int blocknr = next_block(block);
+
+    if (end_of_input(blocknr))
+      break;
+
+    if (blocknr != 1)
+      continue;
+
+    KCFileFormat format  = (kc_is_basic_signature(block)) ? KC_FORMAT_SSS : KC_FORMAT_KCC;
+    unsigned int length  = 0;
+    int          nblocks = parse_start_block(block, format, &length);
+
+    if (nblocks == 0)
+      continue;
+
+    programs = realloc(programs, (nprograms + 1) * sizeof programs[0]);
+
+    if (!programs)
+      kc_exit_error(input->path);
+
+    BatchProgram* prog = &programs[nprograms++];
+    FILE*         mem;
+
+    memcpy(prog->header, block, sizeof prog->header);
+    prog->format  = format;
+    prog->nblocks = nblocks;
+    prog->data    = 0;
+    prog->size    = 0;
+
+    if (!(mem = open_memstream(&prog->data, &prog->size)))
+      kc_exit_error(input->path);
+
+    prog->error     = record_blocks(mem, input->path, format, nblocks, length, block, 0);
+    prog->truncated = (prog->error && stream.endpadding > 0);
+    prog->health    = health;
+
+    if (fclose(mem) != 0)
+      kc_exit_error(input->path);
+
+    if ((truncated = prog->truncated))
+      break;
+  }
+  free_stream(&stream);
+  fclose(infile);
+
+  pthread_mutex_lock(&batch_lock);
+
+  if (truncated)
+  {
+    fprintf(stderr, "%s: Unexpected end of input\n", input->path);
+    ++n_batch_failed;
+  }
+
+  for (size_t i = 0; i < nprograms; ++i)
+  {
+    catalog_program(input->path, &programs[i]);
+    free(programs[i].data);
+  }
+  if (nprograms == 0)
+    fprintf(batchfile, "%s\t-\t-\t-\t-\t-\t0/0\tempty\t-\t-\t-\n", input->path);
+
+  if (fflush(batchfile) != 0)
+    kc_exit_error(batchname);
+
+  if (batch_log)
+  {
+    printf("%s: %zu files\n", input->path, nprograms);
+    fflush(stdout);
+  }
+  pthread_mutex_unlock(&batch_lock);
+
+  free(programs);
+}
+
+static void*
+batch_worker(void* arg)
+{
+  BatchQueue*       queue = arg;
+  const BatchInput* input;
+
+  while ((input = take_input(queue - batch_queues)))
+    (*batch_job)(input);
+
+  return 0;
+}
+
+/* Run the job on each input, on a pool of up to n_jobs worker threads.
+ */
+static void
+run_workers(void (*job)(const BatchInput* input))
+{
+  // Start with the longest recordings, to keep the workers evenly busy.
+  qsort(batch_inputs, n_batch_inputs, sizeof batch_inputs[0], &compare_input_size);
+
+  n_batch_queues = MAX(1u, MIN(n_jobs, n_batch_inputs));
+  batch_queues   = calloc(n_batch_queues, sizeof batch_queues[0]);
+
+  for (unsigned int i = 0; i < n_batch_queues; ++i)
+  {
+    pthread_mutex_init(&batch_queues[i].lock, 0);
+    batch_queues[i].inputs = calloc(n_batch_inputs / n_batch_queues + 1, sizeof(BatchInput*));
+  }
+  for (size_t i = 0; i < n_batch_inputs; ++i)
+  {
+    BatchQueue* queue = &batch_queues[i % n_batch_queues];
+
+    queue->inputs[queue->tail++] = &batch_inputs[i];
+  }
+  batch_job = job;
+
+  for (unsigned int i = 0; i < n_batch_queues; ++i)
+    if (pthread_create(&batch_queues[i].thread, 0, &batch_worker, &batch_queues[i]) != 0)
+    {
+      fputs("Failed to create decoding thread\n", stderr);
+      exit(1);
+    }
+
+  for (unsigned int i = 0; i < n_batch_queues; ++i)
+  {
+    pthread_join(batch_queues[i].thread, 0);
+    pthread_mutex_destroy(&batch_queues[i].lock);
+    free(batch_queues[i].inputs);
+  }
+  free(batch_queues);
+}
+
+/* Decode all recordings found in the directory trees, and catalog the files
+ * recovered.  Each distinct file is stored once in the directory of the
+ * catalog.  Recordings listed in the catalog already are skipped.  Return
+ * the number of recordings that could not be decoded.
+ */
+int
+run_batch(char** trees, int n_trees)
+{
+  const char* slash = strrchr(batchname, '/');
+
+  if (slash)
+    extract_dir = (slash > batchname) ? strndup(batchname, slash - batchname) : "/";
+
+  load_catalog();
+
+  if (!(batchfile = fopen(batchname, "a")))
+    kc_exit_error(batchname);
+
+  if (fseeko(batchfile, 0, SEEK_END) < 0)
+    kc_exit_error(batchname);
+
+  if (ftello(batchfile) == 0)
+    fputs("# input\tname\tformat\tload\tend\tstart\tblocks\thealth\tmargin\thash\tfile\n",
+          batchfile);
+
+  for (int i = 0; i < n_trees; ++i)
+    if (nftw(trees[i], &add_batch_input, 16, FTW_PHYS) != 0)
+      kc_exit_error(trees[i]);
+
+  // Worker threads do their own logging.
+  batch_log     = stdout_isterm;
+  stdout_isterm = 0;
+
+  run_workers(&decode_recording);
+
+  if (fclose(batchfile) != 0)
+    kc_exit_error(batchname);
+
+  if (batch_log)
+    printf("%zu recordings decoded, %zu skipped, %d failed\n",
+           n_batch_inputs - n_batch_failed, n_batch_skipped, n_batch_failed);
+
+  return n_batch_failed;
+}
+
+/* A copy of a block of the file being merged, as found on one input.
+ */
+typedef struct
+{
+  int           slot;       // position in the file, or 0 if unknown
+  int           status;     // block number or BlockStatus
+  uint8_t       bytes[130]; // block number, data and checksum
+  uint8_t       known[130]; // which of the bytes could be decoded?
+}
+BlockCopy;
+
+/* The block copies found on one input, in tape order.
+ */
+typedef struct
+{
+  BlockCopy*    copies;
+  size_t        count;
+  size_t        size;
+  int           anchored;   // position of the copies known?
+}
+CopyList;
+
+enum { LAST_SLOT = INT_MAX }; // position of the KCC end block
+
+enum MergeState
+{
+  MERGE_INTACT,
+  MERGE_VOTED,
+  MERGE_UNCERTAIN,
+  MERGE_MISSING
+};
+
+static const char *const merge_state_names[] =
+{
+  "intact", "voted", "uncertain", "missing"
+};
+
+static CopyList*         merge_lists;  // indexed like batch_inputs
+
+/* Add a block copy to the list of an input, and place it in the file.  An
+ * intact block is placed by its block number, a damaged block right after
+ * the block preceding it.  Damaged blocks found before the first intact one
+ * are placed backwards from there.  Return 0 once the end of the file has
+ * been passed, which is the case if the block numbers start over.  If the
+ * input started within the previous file, the blocks collected up to the
+ * first start block belong to that file, and are dropped.
+ */
+static int
+add_copy(CopyList* list, BlockCopy* copy)
+{
+  if (copy->status == 1)
+  {
+    size_t i = 0;
+
+    while (i < list->count && list->copies[i].slot != 1)
+      ++i;
+
+    if (i == list->count)
+    {
+      list->count    = 0;
+      list->anchored = 0;
+    }
+  }
+  int last = (list->count > 0) ? list->copies[list->count - 1].slot : 0;
+
+  if (last == LAST_SLOT)
+    return 0;
+
+  if (copy->status >= 0)
+  {
+    int blocknr = copy->status;
+
+    if (list->anchored && blocknr != 0xFF && blocknr <= last)
+      return 0;
+
+    copy->slot = (blocknr == 0xFF) ? LAST_SLOT : blocknr;
+
+    if (!list->anchored)
+    {
+      for (size_t i = list->count; i > 0; --i)
+      {
+        BlockCopy* prev = &list->copies[i - 1];
+
+        prev->slot = (blocknr != 0xFF && blocknr > (int)(list->count - i + 1))
+                     ? blocknr - (int)(list->count - i + 1) : 0;
+      }
+      list->anchored = 1;
+    }
+  }
+  else
+    copy->slot = (list->anchored) ? last + 1 : 0;
+
+  if (list->count == list->size)
+  {
+    list->size   = MAX(16u, 2 * list->size);
+    list->copies = realloc(list->copies, list->size * sizeof list->copies[0]);
+
+    if (!list->copies)
+      kc_exit_error("block copies");
+  }
+  list->copies[list->count++] = *copy;
+
+  return 1;
+}
+
+/* Read the blocks of a TAP file, as written by kcrec.  All of them passed the
+ * checksum test when they were recorded.
+ */
+static void
+read_tap_copies(const BatchInput* input, FILE* file, CopyList* list)
+{
+  BlockCopy copy;
+
+  memset(copy.known, 1, sizeof copy.known);
+
+  while (fread(copy.bytes, 129, 1, file) == 1)
+  {
+    unsigned int checksum = 0;
+
+    for (int i = 1; i <= 128; ++i)
+      checksum += copy.bytes[i];
+
+    copy.bytes[129] = checksum;
+    copy.status     = copy.bytes[0];
+
+    if (!add_copy(list, &copy))
+      break;
+  }
+  if (ferror(file))
+    kc_exit_error(input->path);
+}
+
+/* Decode an input to merge, and collect the copies of the blocks of the
+ * first file on it.  For damaged blocks, the bytes are taken from the soft
+ * decisions as far as the decoder got.
+ */
+static void
+collect_copies(const BatchInput* input)
+{
+  CopyList* list = &merge_lists[input - batch_inputs];
+  FILE*     file = fopen(input->path, "rb");
+  char      magic[KC_TAP_MAGIC_LEN];
+
+  if (file && fread(magic, sizeof magic, 1, file) == 1
+      && memcmp(magic, KC_TAP_MAGIC, KC_TAP_MAGIC_LEN) == 0)
+  {
+    read_tap_copies(input, file, list);
+    fclose(file);
+    return;
+  }
+  if (file)
+    fclose(file);
+
+  if (!open_recording(input))
+    return;
+
+  for (;;)
+  {
+    BlockCopy      copy;
+    const Decoder* dec;
+    unsigned int   source;
+
+    copy.status = receive_block(&stream, &copy.bytes[1], &dec, &source);
+
+    if (copy.status == BLOCK_TIMEOUT)
+    {
+      if (stream.endpadding > 0)
+        break;
+      continue;
+    }
+    if (copy.status >= 0)
+    {
+      unsigned int checksum = 0;
+
+      for (int i = 1; i <= 128; ++i)
+        checksum += copy.bytes[i];
+
+      copy.bytes[0]   = copy.status;
+      copy.bytes[129] = checksum;
+      memset(copy.known, 1, sizeof copy.known);
+    }
+    else
+      for (unsigned int i = 0; i < sizeof copy.bytes; ++i)
+      {
+        const int8_t* soft  = &dec->soft[8 * i];
+        unsigned int  byte  = 0;
+        int           known = 0;
+
+        // Bytes erased with diversity reception have all soft decisions 0.
+        for (int k = 0; k < 8 && 8 * i + k < dec->nsoft; ++k)
+        {
+          byte |= (unsigned)(soft[k] > 0) << k;
+          known |= (soft[k] != 0);
+        }
+        copy.bytes[i] = byte;
+        copy.known[i] = known && 8 * (i + 1) <= dec->nsoft;
+      }
+
+    if (!add_copy(list, &copy))
+      break;
+  }
+  free_stream(&stream);
+  fclose(infile);
+}
+
+/* Assemble the block at the given position of the file from all copies
+ * found.  Take an intact copy if there is one, or else vote on each byte.
+ * The result of the vote is trusted only if each byte has a clear majority
+ * and the checksum matches.  A block without any copy is filled with zeros.
+ * Store the number of copies in *ncopies.
+ */
+static enum MergeState
+merge_block(int pos, int blocknr, int nblocks, uint8_t* block, unsigned int* ncopies)
+{
+  unsigned int votes[130][256];
+  int          found = 0;
+
+  memset(votes, 0, sizeof votes);
+  *ncopies = 0;
+
+  for (size_t i = 0; i < n_batch_inputs; ++i)
+    for (size_t k = 0; k < merge_lists[i].count; ++k)
+    {
+      const BlockCopy* copy = &merge_lists[i].copies[k];
+
+      if (copy->slot != pos && !(copy->slot == LAST_SLOT && pos == nblocks && blocknr == 0xFF))
+        continue;
+
+      ++*ncopies;
+
+      if (copy->status == blocknr)
+      {
+        memcpy(block, &copy->bytes[1], 128);
+        found = 1;
+      }
+      for (int b = 0; b < 130; ++b)
+        if (copy->known[b])
+          ++votes[b][copy->bytes[b]];
+    }
+
+  if (found)
+    return MERGE_INTACT;
+
+  if (*ncopies == 0)
+  {
+    memset(block, 0, 128);
+    return MERGE_MISSING;
+  }
+
+  uint8_t      bytes[130];
+  unsigned int checksum = 0;
+  int          clear    = 1;
+
+  for (int b = 0; b < 130; ++b)
+  {
+    unsigned int best = 0, total = 0;
+
+    for (int v = 0; v < 256; ++v)
+    {
+      total += votes[b][v];
+
+      if (votes[b][v] > votes[b][best])
+        best = v;
+    }
+    bytes[b] = best;
+    clear   &= (2 * votes[b][best] > total);
+
+    if (b > 0 && b < 129)
+      checksum += best;
+  }
+  memcpy(block, &bytes[1], 128);
+
+  if (!clear || bytes[0] != blocknr || (checksum & 0xFF) != bytes[129])
+    return MERGE_UNCERTAIN;
+
+  return MERGE_VOTED;
+}
+
+/* Decode several recordings of the same tape, and merge the first file found
+ * into the best possible image.  Inputs may also be TAP files recorded
+ * earlier.  Report the blocks for which no trustworthy copy could be found.
+ * Return the number of such blocks.
+ */
+int
+run_merge(char** inputs, int n_inputs, KCFileFormat format)
+{
+  uint8_t      block[128];
+  unsigned int ncopies;
+  unsigned int length   = 0;
+  unsigned int n_state[MERGE_MISSING + 1] = { 0 };
+
+  for (int i = 0; i < n_inputs; ++i)
+    add_input(inputs[i], 0);
+
+  merge_lists = calloc(n_batch_inputs, sizeof merge_lists[0]);
+
+  run_workers(&collect_copies);
+
+  if (format == KC_FORMAT_ANY)
+  {
+    format = kc_format_from_filename(mergename);
+
+    if (format == KC_FORMAT_ANY)
+      format = KC_FORMAT_TAP;
+  }
+
+  enum MergeState state = merge_block(1, 1, 1, block, &ncopies);
+
+  if (state == MERGE_MISSING)
+  {
+    fputs("No start block found\n", stderr);
+    exit(1);
+  }
+  KCFileFormat base    = (KC_BASE_FORMAT(format) == KC_FORMAT_TAP)
+                         ? ((kc_is_basic_signature(block)) ? KC_FORMAT_SSS : KC_FORMAT_KCC)
+                         : KC_BASE_FORMAT(format);
+  int          nblocks = parse_start_block(block, base, &length);
+
+  if (nblocks == 0)
+  {
+    fputs((base == KC_FORMAT_SSS) ? "Invalid KC-BASIC start block\n"
+                                  : "Invalid KCC start block\n", stderr);
+    exit(1);
+  }
+  if (stdout_isterm)
+    print_start_block(block, base);
+
+  FILE* kcfile;
+
+  if (mergename[0] == '-' && mergename[1] == '\0')
+    kcfile = stdout;
+  else
+    if (!(kcfile = fopen(mergename, "wb")))
+      kc_exit_error(mergename);
+
+  if (KC_BASE_FORMAT(format) == KC_FORMAT_TAP
+      && (fputs(KC_TAP_MAGIC, kcfile) < 0 || putc(1, kcfile) == EOF))
+    kc_exit_error(mergename);
+
+  for (int pos = 1; pos <= nblocks; ++pos)
+  {
+    int blocknr = expected_blocknr(base, pos, nblocks);
+
+    if (pos > 1)
+      state = merge_block(pos, blocknr, nblocks, block, &ncopies);
+
+    ++n_state[state];
+
+    if (state != MERGE_INTACT)
+      fprintf(stderr, "Block %.2X: %s, %u copies\n", blocknr, merge_state_names[state], ncopies);
+
+    write_block(kcfile, mergename, format, pos, blocknr, nblocks, length, block);
+  }
+
+  if (kcfile != stdout && fclose(kcfile) != 0)
+    kc_exit_error(mergename);
+
+  if (stdout_isterm)
+    printf("%u blocks intact, %u voted, %u uncertain, %u missing\n",
+           n_state[MERGE_INTACT], n_state[MERGE_VOTED],
+           n_state[MERGE_UNCERTAIN], n_state[MERGE_MISSING]);
+
+  return n_state[MERGE_UNCERTAIN] + n_state[MERGE_MISSING];
+}
@@ -58,18 +58,15 @@ kc_parse_arg_num(const char* arg, double minval, double maxval, double scale)
   return (int)(value * scale + 0.5);
 }
 
-/* Parse an integer from a string in base 10, base 16 or base 8.
- * Validate the input against the specified range [minval, maxval].
- */
-int
-kc_parse_arg_int(const char* arg, int minval, int maxval)
+static int
+parse_arg_integer(const char* arg, int minval, int maxval, int base)
 {
   assert(arg && *arg != '\0');
 
   char* endptr = 0;
   errno = 0;
 
-  long value = strtol(arg, &endptr, 0);
+  long value = strtol(arg, &endptr, base);
 
   if ((value == 0 || value == LONG_MIN || value == LONG_MAX) && errno != 0)
   {
@@ -78,12 +75,32 @@ kc_parse_arg_int(const char* arg, int minval, int maxval)
   }
   if (!endptr || *endptr != '\0' || !(value >= minval && value <= maxval))
   {
-    fprintf(stderr, "%s: argument out of range [%d..%d]\n", arg, minval, maxval);
+    fprintf(stderr, (base == 16) ? "%s: argument out of range [%X..%X]\n"
+                                 : "%s: argument out of range [%d..%d]\n",
+            arg, minval, maxval);
     exit(1);
   }
   return value;
 }
 
+/* Parse an integer from a string in base 10, base 16 or base 8.
+ * Validate the input against the specified range [minval, maxval].
+ */
+int
+kc_parse_arg_int(const char* arg, int minval, int maxval)
+{
+  return parse_arg_integer(arg, minval, maxval, 0);
+}
+
+/* Parse a hexadecimal integer from a string, such as a KC memory address.
+ * Validate the input against the specified range [minval, maxval].
+ */
+int
+kc_parse_arg_hex(const char* arg, int minval, int maxval)
+{
+  return parse_arg_integer(arg, minval, maxval, 16);
+}
+
 KCFileFormat
 kc_parse_arg_format(const char* arg)
 {
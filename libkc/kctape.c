@@ -26,13 +26,14 @@
 
 static const char extensions[][4] =
 {
-  "KCB", "KCC", "SSS", "TAP", "TTT", "UUU"
+  "KCB", "KCC", "SSS", "TAP", "TTT", "UUU", "WWW"
 };
 
 static const unsigned char formats[] =
 {
   KC_FORMAT_KCB, KC_FORMAT_KCC, KC_FORMAT_SSS,
-  KC_FORMAT_TAP, KC_FORMAT_TTT, KC_FORMAT_UUU
+  KC_FORMAT_TAP, KC_FORMAT_TTT, KC_FORMAT_UUU,
+  KC_FORMAT_WWW
 };
 
 KCFileFormat
@@ -130,3 +131,13 @@ kc_filename_to_tape(KCFileFormat format, const char* filename, uint8_t* buf)
     buf[i] = c;
   }
 }
+
+int
+kc_is_basic_signature(const uint8_t* block)
+{
+  assert(block != 0);
+
+  unsigned int sig = block[0];
+
+  return ((sig & 0xFB) == 0xD3 || (sig & 0xFE) == 0xD4) && block[1] == sig && block[2] == sig;
+}
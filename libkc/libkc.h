@@ -31,7 +31,8 @@ typedef enum
   KC_FORMAT_KCB = 021,
   KC_FORMAT_SSS = 030, /* HC-BASIC binary tape format */
   KC_FORMAT_TTT = 031,
-  KC_FORMAT_UUU = 032
+  KC_FORMAT_UUU = 032,
+  KC_FORMAT_WWW = 033
 }
 KCFileFormat;
 
@@ -47,10 +48,12 @@ KCFileFormat kc_format_from_name(const char* name) G_GNUC_PURE;
 const char* kc_format_name(KCFileFormat format) G_GNUC_PURE;
 KCFileFormat kc_format_from_filename(const char* filename) G_GNUC_PURE;
 void kc_filename_to_tape(KCFileFormat format, const char* filename, uint8_t* buf);
+int kc_is_basic_signature(const uint8_t* block) G_GNUC_PURE;
 
 void kc_exit_error(const char* where) G_GNUC_NORETURN;
 int kc_parse_arg_num(const char* arg, double minval, double maxval, double scale);
 int kc_parse_arg_int(const char* arg, int minval, int maxval);
+int kc_parse_arg_hex(const char* arg, int minval, int maxval);
 KCFileFormat kc_parse_arg_format(const char* arg);
 
 G_END_DECLS
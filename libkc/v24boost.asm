@@ -18,17 +18,78 @@
 ; V.24 receive program for the 19200 Baud boost mode of kcsend.
 ; This program is written into the cassette tape buffer and then
 ; executed to receive the bulk of the data at a rate of roughly
-; 19200 Baud instead of the 1200 Baud default.  After each block
-; of 128 Byte, a checksum is sent back to the sender to provide
-; rudimentary integrity verification.
+; 19200 Baud instead of the 1200 Baud default.  The data arrives
+; in blocks of up to 128 Byte, each preceded by its length, target
+; address, and a check byte which makes the sum of the four zero.
+; A block of length zero ends the transfer, and so does a damaged
+; header, rather than letting the block go to the wrong place.
+; After each block, the block number and a checksum are sent back
+; to the sender, which keeps several blocks in flight, matches the
+; replies by number, and sends a block again if its checksum is
+; wrong.  The block number starts from whatever is left in L, and
+; the sender takes it from the first reply.
+; The sender patches the CTC time constant of the first instruction
+; to start at a faster or slower rate found earlier.
+;
+; The cassette tape buffer is too small for anything else, so the
+; handlers of the other block types live in an extension which is
+; assembled for the ASCII screen buffer.  The sender transfers it as
+; plain blocks once the program runs.  The output text of the screen
+; is lost, but CAOS does not touch that memory while nothing is
+; printed.  Block types from 81h up are dispatched to the extension:
+;
+; 81h	run-length encoded block: unpacked length, address, check
+;	byte as above, and codes n < 80h followed by n + 1 literal
+;	bytes, or n >= 80h followed by one byte repeated n - 125 times;
+;	a code beyond the end of the block ends the transfer
+; 82h	checksum request, only with CRC set up: number of 128 Byte
+;	blocks and address; for each block, the high and low byte of
+;	its CRC are sent back ahead of the acknowledgement
+; 83h	rate change: new and old CTC time constant, and a check byte
+;	which makes the sum zero; after the acknowledgement, 256 test
+;	bytes are received at the new rate and their sum is sent back;
+;	unless the sender then confirms with 0A5h, the old rate is
+;	restored as soon as the line has been quiet for a second
+; 86h	CRC setup: builds the table for the CRC-16 with polynomial
+;	1021h, and switches over to blocks with CRC for the rest of
+;	the transfer
+; 87h	striping setup: CTC time constant for channel A of the M003
+;	module; after the acknowledgement, the bytes are received in
+;	turns from channel A and B, starting with A, while the replies
+;	stay on channel B.  This has to come before the CRC setup
+;
+; With CRC, every block starts with type, length, address, and a
+; check byte which makes the sum of the five 0A5h, so that a run of
+; zeros is not taken for the end.  A block with a damaged header or
+; a length outside of 1 to 128 is dropped together with everything
+; that follows until the line has been quiet for a second, while the
+; loader stays ready to receive.  Type 0 ends the transfer, and 82h
+; is a checksum request as above.  Type 84h is followed by data, and
+; 85h by run-length codes as for 81h.  The
+; CRC covers all bytes of the blocks since the last acknowledgement.
+; A block is only acknowledged if 08h is added to its type, with the
+; block number followed by the high and low byte of the CRC.  The
+; block number only counts acknowledgements, so a sender which waits
+; for several blocks at once has to send all of them again after a
+; CRC error.  When striping, the line has to be quiet on both channels
+; before the next byte is taken from channel A again.
+;
+; Striping interleaves single bytes rather than whole blocks, as each
+; channel holds only three bytes while the other one is served, and
+; the handshake stops the sender on a channel which is not polled.
 
 ; Command to assemble and output hex dump:
 ; z80asm -o - libkc/v24boost.asm | hexdump -e '8/1 "0x%.2X, " "\n"'
 
 tapbuf:	equ	0B700h		; address of cassette tape buffer
+extbuf:	equ	0B200h		; address of ASCII screen buffer
+crctab:	equ	0B500h		; CRC table, in the ASCII screen buffer too
 sioc:	equ	0Bh
 siod:	equ	09h
 ctc:	equ	0Dh
+sioca:	equ	0Ah		; SIO channel A
+sioda:	equ	08h
+ctca:	equ	0Ch
 trconf:	equ	01101010b	; DTR off, 8 bit, transmit enable, RTS on
 
 	db	54h		; 'T' command
@@ -37,18 +98,25 @@ trconf:	equ	01101010b	; DTR off, 8 bit, transmit enable, RTS on
 
 	org	tapbuf
 
-	ld	bc,0100h * v24il + 3	; 18400 Baud polling mode
+	ld	bc,0100h * v24il + 3	; 18400 Baud polling mode (patched)
 	call	v24ini
 
+block:	call	cin		; block length, or 0 at the end
+	or	a
+	jr	z,drain
+	cp	81h
+	jp	nc,extcmd	; other block type
+	ld	c,a
 	call	cin
-	ld	e,a		; de = start address
+	ld	e,a		; de = block address
 	call	cin
 	ld	d,a
+	add	a,e
+	add	a,c
+	ld	b,a		; checksum = length + address
 	call	cin
-	ld	l,a		; hl = byte count
-	call	cin
-	ld	h,a
-	jr	lcond
+	add	a,b		; header intact?
+	jr	nz,drain
 
 loop:	call	cin
 	ld	(de),a
@@ -58,21 +126,20 @@ loop:	call	cin
 	dec	c
 	jr	nz,loop
 
-cout:	in	a,(sioc)
-	and	00000100b	; transmit buffer empty?
-	jr	z,cout
+ack:	ld	a,l		; acknowledge block number and checksum
+	inc	l
+	call	cout
 	ld	a,b
-	out	(siod),a	; send byte
+	call	cout
+	jr	block
 
-lcond:	ld	bc,0080h	; checksum = 0, byte count = block size
-	xor	a		; cy = 0
-	sbc	hl,bc
-	jr	nc,loop
-	add	hl,bc
-	ld	c,l		; c = remainder
-	ld	l,a		; l = 0
-	cp	c		; remainder = 0?
-	jr	c,loop
+cout:	ld	c,a
+cwait:	in	a,(sioc)
+	and	00000100b	; transmit buffer empty?
+	jr	z,cwait
+	ld	a,c
+	out	(siod),a	; send byte
+	ret
 
 drain:	ld	a,1		; select RR1
 	di
@@ -119,4 +186,443 @@ v24il:	equ	$ - v24tab
 	db	11h,00011000b	; interrupt reset and enable
 v24rl:	equ	$ - v24tab
 
-pend:	end
+pend:
+	dw	extbuf		; address of the extension
+	dw	xend - extbuf	; extension length
+
+	org	extbuf
+
+	; Receive a byte in turns from channel A and B while striping,
+	; with the same handshake as cin, which then jumps here.  Both
+	; halves stay in the first page, as only the low byte of the
+	; jump to the next one is changed.
+scin:	jp	cina
+
+cina:	in	a,(sioca)
+	rrca			; data waiting?
+	ccf
+	ld	a,5		; select WR5
+	di
+	out	(sioca),a
+	ld	a,2 * trconf
+	rra			; DTR off if data is waiting
+	out	(sioca),a	; signal ready or busy to sender
+	ei
+	rlca			; data waiting?
+	jr	c,cina
+	ld	a,cinb & 0FFh	; channel B next
+	ld	(scin + 1),a
+	in	a,(sioda)	; read received byte
+	ret
+
+cinb:	in	a,(sioc)
+	rrca			; data waiting?
+	ccf
+	ld	a,5		; select WR5
+	di
+	out	(sioc),a
+	ld	a,2 * trconf
+	rra			; DTR off if data is waiting
+	out	(sioc),a	; signal ready or busy to sender
+	ei
+	rlca			; data waiting?
+	jr	c,cinb
+	ld	a,cina & 0FFh	; channel A next
+	ld	(scin + 1),a
+	in	a,(siod)	; read received byte
+	ret
+
+extcmd:	cp	83h
+	jp	z,rate
+	cp	86h
+	jp	z,crcinit
+	cp	87h
+	jp	z,stripe
+
+	call	cin
+	ld	c,a		; c = unpacked length
+	call	cin
+	ld	e,a		; de = block address
+	call	cin
+	ld	d,a
+	add	a,e
+	add	a,c
+	ld	b,a		; checksum = length + address
+	call	cin
+	add	a,b		; header intact?
+	jp	nz,drain
+
+code:	call	cin
+	cp	80h		; run of repeated bytes?
+	jr	nc,run
+	inc	a
+	ld	h,a		; h = number of literal bytes
+	ld	a,c
+	cp	h		; more than the rest of the block?
+	jp	c,drain
+literal:
+	call	cin
+	call	store
+	jr	nz,literal
+	jr	next
+
+run:	sub	125
+	ld	h,a		; h = repeat count
+	ld	a,c
+	cp	h		; more than the rest of the block?
+	jp	c,drain
+	call	cin
+repeat:	call	store
+	jr	nz,repeat
+
+next:	ld	a,c
+	or	a		; block complete?
+	jr	nz,code
+	jp	ack
+
+store:	ld	(de),a
+	add	a,b		; checksum
+	ld	b,a
+	ld	a,(de)
+	inc	de
+	dec	c
+	dec	h
+	ret
+
+qhead:	ld	a,c
+	add	a,e
+	add	a,d
+	push	af		; checksum = block count + address
+	push	hl		; keep block number
+
+qblock:	ld	b,128
+	ld	hl,0FFFFh
+qcbyte:	ld	a,(de)
+	inc	de
+	call	crcbyte
+	djnz	qcbyte
+
+qsend:	push	bc
+	ld	a,h
+	call	cout
+	ld	a,l
+	call	cout
+	pop	bc
+	dec	c
+	jr	nz,qblock
+
+	pop	hl
+	pop	af
+	ld	b,a
+	jp	ack
+
+rate:	call	cin
+	ld	e,a		; e = new time constant
+	call	cin
+	ld	d,a		; d = old time constant
+	add	a,e
+	ld	h,a
+	call	cin
+	add	a,h
+	ld	h,a		; h = 0 if the request is intact
+	add	a,83h
+	ld	b,a		; checksum = sum of the request
+
+	ld	a,l		; acknowledge at the old rate
+	inc	l
+	call	cout
+	ld	a,b
+	call	cout
+	ld	a,h
+	or	a
+	jp	nz,block	; damaged request, keep the rate
+
+	push	hl		; keep block number
+	call	flush
+	ld	c,e
+	call	setrate
+	ld	bc,0		; b = 256 test bytes, c = checksum
+tbyte:	call	tcin
+	jr	c,revert
+	add	a,c
+	ld	c,a
+	djnz	tbyte
+	call	cout		; send checksum of the test bytes
+	call	tcin
+	jr	c,revert
+	cp	0A5h		; new rate confirmed?
+	jr	z,rdone
+
+revert:	call	tcin		; wait until the line is quiet
+	jr	nc,revert
+	ld	c,d
+	call	setrate
+rdone:	pop	hl
+	jp	block
+
+flush:	ld	a,1		; select RR1
+	di
+	out	(sioc),a
+	in	a,(sioc)
+	ei
+	rrca			; all sent?
+	jr	nc,flush
+	ret
+
+setrate:
+	ld	b,v24il		; c = CTC time constant
+	jp	v24ini
+
+	; Receive a byte, with carry set if there is none for about
+	; a second.  The handshake is left alone, as the sender is
+	; never ahead by more than the receive buffer.
+tcin:	ld	hl,8000h
+twait:	in	a,(sioc)
+	rrca			; data waiting?
+	jr	c,tread
+	dec	hl
+	ld	a,h
+	or	l
+	jr	nz,twait
+	scf
+	ret
+tread:	in	a,(siod)	; read received byte
+	or	a		; clear carry
+	ret
+
+crcinit:
+	push	hl		; keep block number
+	ld	de,crctab	; e = table index
+tgen:	ld	h,e		; CRC of the index byte, bit by bit
+	ld	l,0
+	ld	b,8
+tbit:	add	hl,hl
+	jr	nc,tnext
+	ld	a,h
+	xor	10h		; polynomial 1021h
+	ld	h,a
+	ld	a,l
+	xor	21h
+	ld	l,a
+tnext:	djnz	tbit
+	ld	a,h
+	ld	(de),a		; high bytes in the first page
+	inc	d
+	ld	a,l
+	ld	(de),a		; low bytes in the second page
+	dec	d
+	inc	e
+	jr	nz,tgen
+
+	ld	hl,0FFFFh
+	ld	(crc),hl
+	ld	a,0C3h		; from now on, jp cblock at the start
+	ld	(block),a	; of the receive loop
+	ld	hl,cblock
+	ld	(block + 1),hl
+	pop	hl
+	ld	b,86h		; checksum of the request
+	jp	ack
+
+cblock:	call	cin
+	ld	h,a		; h = block type
+	call	cin
+	ld	c,a		; c = (unpacked) length
+	call	cin
+	ld	e,a		; de = block address
+	call	cin
+	ld	d,a
+	call	cin
+	ld	b,a		; b = header check byte
+	add	a,h
+	add	a,c
+	add	a,e
+	add	a,d
+	cp	0A5h		; header intact?
+	jp	nz,resync
+	ld	a,h
+	or	a
+	jp	z,drain		; end of transfer
+	cp	82h
+	jp	z,qhead
+	and	0F6h
+	cp	84h		; block with CRC?
+	jp	nz,resync
+	ld	a,c
+	dec	a
+	cp	128		; length from 1 to 128?
+	jp	nc,resync
+
+	ld	a,h
+	push	hl		; keep block number
+	push	af		; keep block type
+	ld	hl,(crc)
+	call	crcbyte		; the header is part of the CRC
+	ld	a,c
+	call	crcbyte
+	ld	a,e
+	call	crcbyte
+	ld	a,d
+	call	crcbyte
+	ld	a,b
+	call	crcbyte
+	pop	af
+	push	af
+	rrca			; run-length encoded?
+	jr	c,ccode
+
+craw:	call	cin
+	ld	(de),a
+	inc	de
+	call	crcbyte
+	dec	c
+	jr	nz,craw
+	jr	cend
+
+ccode:	call	cin
+	call	crcbyte
+	cp	80h		; run of repeated bytes?
+	jr	nc,crun
+	inc	a
+	ld	b,a		; b = number of literal bytes
+	ld	a,c
+	cp	b		; more than the rest of the block?
+	jr	c,cbad
+clit:	call	cin
+	call	crcbyte
+	ld	(de),a
+	inc	de
+	dec	c
+	djnz	clit
+	jr	cnext
+
+crun:	sub	125
+	ld	b,a		; b = repeat count
+	ld	a,c
+	cp	b		; more than the rest of the block?
+	jr	c,cbad
+	call	cin
+	call	crcbyte
+crep:	ld	(de),a
+	inc	de
+	dec	c
+	djnz	crep
+
+cnext:	ld	a,c
+	or	a		; block complete?
+	jr	nz,ccode
+
+cend:	pop	af
+	and	08h		; acknowledge now?
+	jr	nz,crcack
+	ld	(crc),hl
+	pop	hl
+	jp	cblock
+
+crcack:	ex	de,hl		; de = CRC
+	pop	hl
+	ld	a,l		; acknowledge block number and CRC
+	inc	l
+	call	cout
+	ld	a,d
+	call	cout
+	ld	a,e
+	call	cout
+	ld	de,0FFFFh
+	ld	(crc),de
+	jp	cblock
+
+cbad:	pop	af		; damaged code byte
+	pop	hl
+
+resync:	push	hl		; keep block number
+	ld	a,(cin)
+	cp	0C3h		; striping?
+	ld	c,sioc		; ready to receive, so that the sender is
+	call	ready		; not held while everything is dropped
+	ld	c,sioca
+	call	z,ready
+rquiet:	call	tcin		; drop everything until the line is quiet
+	jr	nc,rquiet
+	ld	a,(cin)
+	cp	0C3h		; striping?
+	call	z,aquiet
+	ld	hl,0FFFFh
+	ld	(crc),hl
+	pop	hl
+	jp	cblock
+
+	; Turn DTR on for the SIO channel with the control port in c.
+ready:	ld	a,5		; select WR5
+	di
+	out	(c),a
+	ld	a,10000000b + trconf
+	out	(c),a
+	ei
+	ret
+
+	; Update the CRC in hl with the byte in a.  Only the flags
+	; are changed.
+crcbyte:
+	push	de
+	push	af
+	xor	h
+	ld	e,a		; e = table index
+	ld	d,crctab / 256
+	ld	a,(de)
+	xor	l
+	ld	h,a
+	inc	d
+	ld	a,(de)
+	ld	l,a
+	pop	af
+	pop	de
+	ret
+
+	; Drop everything on channel A until it is quiet, and take the
+	; next byte from there.
+aquiet:	call	tswap
+aqwait:	call	tcin
+	jr	nc,aqwait
+	call	tswap
+	ld	a,cina & 0FFh
+	ld	(scin + 1),a
+	ret
+
+	; Switch tcin over to the other channel.
+tswap:	ld	hl,twait + 1
+	ld	a,(hl)
+	xor	sioc ^ sioca
+	ld	(hl),a
+	ld	hl,tread + 1
+	ld	a,(hl)
+	xor	siod ^ sioda
+	ld	(hl),a
+	ret
+
+stripe:	call	cin
+	ld	c,a		; c = CTC time constant
+	add	a,87h
+	ld	b,a		; checksum of the request
+	push	bc
+	push	hl		; keep block number
+	ld	a,01000111b	; reset counter, time constant follows
+	di
+	out	(ctca),a
+	ld	a,c
+	out	(ctca),a
+	ld	hl,v24tab	; polling mode as for channel B
+	ld	bc,0100h * v24il + sioca
+	otir
+	ei
+	ld	a,0C3h		; from now on, jp scin at the start of cin
+	ld	(cin),a
+	ld	hl,scin
+	ld	(cin + 1),hl
+	pop	hl
+	pop	bc
+	jp	ack
+
+crc:	dw	0FFFFh		; CRC of the blocks since the last acknowledgement
+
+xend:	end
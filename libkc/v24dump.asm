@@ -0,0 +1,126 @@
+; Copyright (c) 2010  Daniel Elstner <daniel.kitta@gmail.com>
+;
+; This file is part of KC-I/O.
+;
+; KC-I/O is free software: you can redistribute it and/or modify it
+; under the terms of the GNU General Public License as published by the
+; Free Software Foundation, either version 3 of the License, or
+; (at your option) any later version.
+;
+; KC-I/O is distributed in the hope that it will be useful, but
+; WITHOUT ANY WARRANTY; without even the implied warranty of
+; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+; See the GNU General Public License for more details.
+;
+; You should have received a copy of the GNU General Public License along
+; with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+; V.24 send program for reading back memory with kcdump.
+; This program is written into the cassette tape buffer and then
+; executed to send memory contents at a rate of roughly 19200 Baud.
+; The receiver requests blocks of up to 128 Byte by length and
+; address.  A request of length zero ends the transfer.  Each block
+; is followed by the block number and a checksum over the request
+; and the data, so that the receiver can request it again.
+
+; Command to assemble and output hex dump:
+; z80asm -o - libkc/v24dump.asm | hexdump -e '8/1 "0x%.2X, " "\n"'
+
+tapbuf:	equ	0B700h		; address of cassette tape buffer
+sioc:	equ	0Bh
+siod:	equ	09h
+ctc:	equ	0Dh
+trconf:	equ	01101010b	; DTR off, 8 bit, transmit enable, RTS on
+
+	db	54h		; 'T' command
+	dw	tapbuf		; address of cassette tape buffer
+	dw	pend - tapbuf	; program length
+
+	org	tapbuf
+
+	ld	bc,0100h * v24il + 3	; 18400 Baud polling mode
+	call	v24ini
+
+	ld	l,0		; l = block number
+
+block:	call	cin		; block length, or 0 at the end
+	or	a
+	jr	z,drain
+	ld	c,a
+	call	cin
+	ld	e,a		; de = block address
+	call	cin
+	ld	d,a
+	add	a,e
+	add	a,c
+	ld	b,a		; checksum = length + address
+
+loop:	ld	a,(de)
+	inc	de
+	call	cout
+	add	a,b		; checksum
+	ld	b,a
+	dec	c
+	jr	nz,loop
+
+	ld	a,l		; send block number and checksum
+	inc	l
+	call	cout
+	ld	a,b
+	call	cout
+	jr	block
+
+cout:	ld	h,a
+cwait:	in	a,(sioc)
+	and	00000100b	; transmit buffer empty?
+	jr	z,cwait
+	ld	a,h
+	out	(siod),a	; send byte
+	ret
+
+drain:	ld	a,1		; select RR1
+	di
+	out	(sioc),a
+	in	a,(sioc)
+	ei
+	rrca			; all sent?
+	jr	nc,drain
+
+	ld	bc,0100h * v24rl + 46	; 1200 Baud interrupt mode
+	; b = I/O table length
+	; c = CTC time constant
+v24ini:	ld	hl,v24tab
+	ld	a,01000111b	; reset counter, time constant follows
+	di
+	out	(ctc),a
+	ld	a,c
+	out	(ctc),a
+	ld	c,sioc
+	otir
+	ei
+	ret
+
+cin:	in	a,(sioc)
+	rrca			; data waiting?
+	ccf
+	ld	a,5		; select WR5
+	di
+	out	(sioc),a
+	ld	a,2 * trconf
+	rra			; DTR off if data is waiting
+	out	(sioc),a	; signal ready or busy to sender
+	ei
+	rlca			; data waiting?
+	jr	c,cin
+	in	a,(siod)	; read received byte
+	ret
+
+v24tab:	db	00011000b	; channel reset
+	db	4,01000100b	; x16 clock, 1 stop bit, no parity
+	db	3,11100001b	; 8 bit, auto enables, receive enable
+	db	5,10000000b + trconf
+v24il:	equ	$ - v24tab
+	db	11h,00011000b	; interrupt reset and enable
+v24rl:	equ	$ - v24tab
+
+pend:	end